@@ -0,0 +1,24 @@
+#ifndef ACPI_H
+#define ACPI_H
+#include <stdint.h>
+#include <stddef.h>
+
+struct acpi_header {
+    char signature[4];
+    uint32_t length;        // Whole table, header included
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+// Map the first table with this signature ("APIC", "HPET", ...) through
+// vmalloc space. NULL if the firmware has none; unmap with acpi_unmap_table.
+// Only valid while the Limine RSDP response is, i.e. before the reclaim.
+struct acpi_header *acpi_map_table(const char *signature);
+void acpi_unmap_table(struct acpi_header *table);
+
+#endif // ACPI_H
\ No newline at end of file
@@ -0,0 +1,67 @@
+#ifndef APIC_H
+#define APIC_H
+#include <stdint.h>
+#include <stdbool.h>
+
+// Bring up the BSP's local APIC (x2APIC when the CPU has it), then route the
+// ISA IRQs through the IOAPICs in the MADT and mask the 8259. Without a MADT
+// or IOAPIC they stay on the 8259, the local APIC still serves IPIs and the
+// timer. Call after vmalloc_init and idt_init, before the bootloader memory
+// is reclaimed.
+void apic_init(void);
+
+// Enable the calling CPU's local APIC; apic_init does it for the BSP
+void apic_init_cpu(void);
+
+// False when the CPU has no local APIC, no IPIs or APIC timer then
+bool apic_present(void);
+
+uint32_t apic_id(void);
+
+// Route a legacy ISA IRQ to vector IRQ_VECTOR_BASE + irq on the BSP and
+// unmask it
+void irq_enable(uint8_t irq);
+
+// Signal end of interrupt for vector, call before returning from a handler
+void irq_eoi(uint8_t vector);
+
+// Send a fixed interrupt on vector to the CPU with local APIC ID dest
+void apic_send_ipi(uint32_t dest, uint8_t vector);
+
+// Fire APIC_TIMER_VECTOR hz times a second on the calling CPU. apic_init
+// calibrates the timer against the PIT. False without a local APIC.
+bool apic_timer_start(uint32_t hz);
+
+#define IRQ_VECTOR_BASE 32
+#define APIC_TIMER_VECTOR 0x30     // First vector after the ISA IRQs
+#define TLB_SHOOTDOWN_VECTOR 0xF0   // IPI, see vmm.c
+#define APIC_SPURIOUS_VECTOR 0xFF
+#define IOAPIC_MAX 8
+
+#define MSR_APIC_BASE 0x1B
+#define APIC_BASE_ENABLE (1ULL << 11)
+#define APIC_BASE_X2APIC (1ULL << 10)
+#define APIC_BASE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+#define CPUID_APIC   (1 << 9)       // Leaf 1 EDX
+#define CPUID_X2APIC (1 << 21)      // Leaf 1 ECX
+
+// Local APIC register offsets (xAPIC MMIO; x2APIC MSR is 0x800 + reg / 16)
+#define LAPIC_ID    0x020
+#define LAPIC_TPR   0x080
+#define LAPIC_EOI   0x0B0
+#define LAPIC_SVR   0x0F0
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_ICR_LOW    0x300      // One register in x2APIC mode
+#define LAPIC_ICR_HIGH   0x310
+#define LAPIC_ICR_PENDING (1 << 12)
+#define LAPIC_LVT_TIMER  0x320
+#define LAPIC_LVT_LINT0  0x350
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR  0x390
+#define LAPIC_TIMER_DIV  0x3E0
+#define LAPIC_DELIVERY_EXTINT (7 << 8)
+#define LAPIC_TIMER_PERIODIC (1 << 17)
+#define LAPIC_LVT_MASKED     (1 << 16)
+
+#endif // APIC_H
\ No newline at end of file
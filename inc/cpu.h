@@ -0,0 +1,140 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Upper bound on CPUs the per-CPU arrays are sized for
+#define MAX_CPUS 64
+
+#define CACHE_LINE_SIZE 64
+
+struct thread;
+
+// Per-CPU block. In kernel mode GS base points at the running CPU's one
+// (smp.c), so a field is a single %gs-relative load, no lookup or lock.
+struct cpu {
+    struct cpu *self;       // %gs:0, turns GS into a plain pointer
+    uint32_t id;            // Dense index into the MAX_CPUS arrays, BSP is 0
+    uint32_t apic_id;
+    uint64_t kernel_stack;  // Stack top for entries from user mode: the boot
+                            // stack, then the running thread's
+    struct thread *current; // Running thread, NULL before sched_init_cpu
+    struct thread *idle;    // The CPU's boot context, runs when nothing else can
+    uint32_t preempt_count; // Non-zero: no involuntary switch (spinlocks, work_run)
+    bool need_resched;      // Switch at the next preemption point
+    uint64_t user_rsp;      // Scratch for the SYSCALL entry (syscall.asm)
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static inline struct cpu *this_cpu(void) {
+    struct cpu *cpu;
+    __asm__ volatile ("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// Index of the CPU we are running on
+static inline uint32_t cpu_id(void) {
+    uint32_t id;
+    __asm__ volatile ("movl %%gs:%c1, %0" : "=r"(id) : "i"(offsetof(struct cpu, id)));
+    return id;
+}
+
+// Nest freely; the scheduler won't take the CPU away in between, though
+// interrupts still come in
+static inline void preempt_disable(void) {
+    __asm__ volatile ("incl %%gs:%c0" : : "i"(offsetof(struct cpu, preempt_count)) : "memory");
+}
+
+static inline void preempt_enable(void) {
+    __asm__ volatile ("decl %%gs:%c0" : : "i"(offsetof(struct cpu, preempt_count)) : "memory");
+}
+
+// Disable interrupts and return the previous RFLAGS
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile ("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Re-enable interrupts only if they were enabled when irq_save() ran
+static inline void irq_restore(uint64_t flags) {
+    if (flags & (1 << 9)) { // IF
+        __asm__ volatile ("sti" : : : "memory");
+    }
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    __asm__ volatile ("cpuid"
+                      : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                      : "a"(leaf), "c"(subleaf));
+}
+
+static inline uint64_t read_cr0(void) {
+    uint64_t cr0;
+    __asm__ volatile ("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void write_cr0(uint64_t cr0) {
+    __asm__ volatile ("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+#define CR0_MP    (1ULL << 1)
+#define CR0_EM    (1ULL << 2)
+#define CR0_TS    (1ULL << 3)
+#define CR0_NE    (1ULL << 5)
+#define CR0_WP    (1ULL << 16)
+
+static inline uint64_t read_cr4(void) {
+    uint64_t cr4;
+    __asm__ volatile ("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint64_t cr4) {
+    __asm__ volatile ("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+#define CR4_PGE        (1ULL << 7)
+#define CR4_OSFXSR     (1ULL << 9)
+#define CR4_OSXMMEXCPT (1ULL << 10)
+#define CR4_PCIDE      (1ULL << 17)
+#define CR4_OSXSAVE    (1ULL << 18)
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile ("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) : "memory");
+}
+
+#define MSR_IA32_PAT 0x277
+#define MSR_GS_BASE        0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102   // swapgs exchanges it with GS base
+#define MSR_EFER   0xC0000080
+#define MSR_STAR   0xC0000081
+#define MSR_LSTAR  0xC0000082
+#define MSR_FMASK  0xC0000084
+#define EFER_SCE   (1ULL << 0)      // SYSCALL/SYSRET enable
+
+// Jump onto a fresh stack and continue in entry; never returns
+__attribute__((noreturn))
+static inline void switch_stack(uint64_t stack_top, void (*entry)(void)) {
+    // call (not jmp) so entry sees the usual rsp % 16 == 8 on entry
+    __asm__ volatile (
+        "mov %0, %%rsp\n\t"
+        "xor %%ebp, %%ebp\n\t"
+        "call *%1"
+        :: "r"(stack_top), "r"(entry) : "memory");
+    __builtin_unreachable();
+}
+
+static inline void cpu_relax(void) {
+    __asm__ volatile ("pause" : : : "memory");
+}
+
+#endif // CPU_H
\ No newline at end of file
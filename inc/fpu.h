@@ -0,0 +1,30 @@
+#ifndef FPU_H
+#define FPU_H
+#include <stdint.h>
+#include <stdbool.h>
+
+// x87/SSE/AVX state of one thread, in an XSAVE (or FXSAVE) area
+struct fpu_state;
+
+// Enable SSE (and AVX when present) on the calling CPU and leave CR0.TS set,
+// so the first FPU instruction traps to fpu_handle_nm. Call once per CPU.
+void fpu_init(void);
+bool fpu_ready(void);       // fpu_init ran, kernel_fpu_begin may be used
+bool fpu_has_avx(void);
+
+// Kernel code may only touch vector registers between these two, and only
+// from files built as *.simd.c (see GNUmakefile). Interrupts are off in
+// between and regions don't nest.
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
+// Per-thread state for the scheduler. Switching is lazy: fpu_switch only
+// sets CR0.TS, the registers are saved and reloaded on the next #NM.
+struct fpu_state *fpu_state_alloc(void);
+void fpu_state_free(struct fpu_state *state);
+void fpu_switch(struct fpu_state *next);
+
+// #NM (device not available). Returns false if nothing should own the FPU.
+bool fpu_handle_nm(void);
+
+#endif // FPU_H
\ No newline at end of file
@@ -44,6 +44,14 @@ struct gdtr {
     uint64_t base;
 } __attribute__((packed));
 
+// Selectors, user ones without the RPL bits
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_USER_DATA   0x18
+#define GDT_USER_CODE   0x20
+#define GDT_TSS         0x28
+
+// Load the calling CPU's own GDT and TSS; GS base must be set already
 void gdt_init(void);
 void tss_set_stack(uint64_t stack_ptr);
 
@@ -2,6 +2,7 @@
 #define IDT_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #define IDT_ENTRIES 256
 
@@ -30,5 +31,23 @@ struct interrupt_frame {
 };
 
 void idt_init(void);
+void idt_init_cpu(void);    // Load the IDT on an AP, idt_init did the BSP
+
+// Handler for an external vector (32-255). Runs with interrupts off, the
+// dispatcher sends the EOI once it returns. Anything slow belongs in a
+// work item (work.h), which runs after the EOI with interrupts on.
+typedef void (*irq_handler_t)(struct interrupt_frame *frame, void *ctx);
+
+// Install a handler, false if vector is an exception or already taken
+bool irq_register(uint8_t vector, irq_handler_t handler, void *ctx);
+void irq_unregister(uint8_t vector);
+
+// How many times vector has fired, summed over all CPUs
+uint64_t irq_count(uint8_t vector);
+
+// Legacy 8259, only used when there is no IOAPIC (see apic.c)
+void pic_unmask(uint8_t irq);
+void pic_disable(void);
+void pic_eoi(uint8_t irq);
 
 #endif
\ No newline at end of file
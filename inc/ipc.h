@@ -0,0 +1,81 @@
+#ifndef IPC_H
+#define IPC_H
+#include <stdint.h>
+#include <spinlock.h>
+
+struct thread;
+
+// Synchronous IPC. A message is a tag and a few words, small enough to stay
+// in registers; it is copied straight from the sender to the blocked
+// receiver, never buffered in the endpoint.
+
+#define IPC_MSG_WORDS 4
+
+struct ipc_msg {
+    uint64_t tag;
+    uint64_t words[IPC_MSG_WORDS];
+};
+
+// Bulk data goes by page table: with IPC_TAG_GRANT, words[0] and words[1]
+// name pages in the sender's space that end up in the receiver's window
+// (see ipc_set_window), and the receiver sees words[0] rewritten to the
+// window. The pages move unless IPC_TAG_SHARE is set too. If they can't be
+// transferred the message still arrives, with IPC_TAG_GRANT_FAILED instead.
+#define IPC_TAG_GRANT        (1ULL << 63)
+#define IPC_TAG_SHARE        (1ULL << 62)
+#define IPC_TAG_GRANT_FAILED (1ULL << 61)
+#define IPC_TAG_LABEL(tag)   ((tag) & ((1ULL << 61) - 1))
+
+// A rendezvous point. Threads wait here in FIFO order, either senders for
+// a receiver or receivers for a sender, never both.
+struct endpoint {
+    spinlock_t lock;
+    struct thread *senders, *senders_tail;
+    struct thread *receivers, *receivers_tail;
+};
+
+#define IPC_OK     0
+#define IPC_EINVAL 1    // The idle thread can't block, or nobody to reply to
+#define IPC_EHANDLE 2   // No endpoint behind that handle
+
+struct endpoint *endpoint_create(void);
+// Nobody may be waiting on it
+void endpoint_destroy(struct endpoint *ep);
+
+// Send msg and wait for the reply, which overwrites msg. With a receiver
+// waiting, the CPU goes straight to it.
+int ipc_call(struct endpoint *ep, struct ipc_msg *msg);
+
+// Reply with msg to whoever we last received a call from (if anyone), then
+// wait for the next call into msg. Goes straight back to the caller when
+// nobody else is waiting to send.
+int ipc_reply_and_wait(struct endpoint *ep, struct ipc_msg *msg);
+
+// Reply without waiting, the caller goes on the run queue
+int ipc_reply(struct ipc_msg *msg);
+
+// Accept granted pages at [addr, addr + pages * PAGE_SIZE) of our own space;
+// they only land where nothing is mapped yet
+void ipc_set_window(uint64_t addr, uint64_t pages);
+
+// Give t a handle on ep for the system calls, -1 if its table is full.
+// The endpoint must outlive the thread.
+int ipc_handle_install(struct thread *t, struct endpoint *ep);
+
+// SYS_IPC_CALL and SYS_IPC_REPLY_WAIT, see syscall.h for the registers
+uint64_t ipc_sys_call(uint64_t *args);
+uint64_t ipc_sys_reply_wait(uint64_t *args);
+
+// Kernel thread serving the endpoint arg: answers every call with words[0]
+// incremented, and exits after answering IPC_ECHO_STOP
+#define IPC_ECHO_PING 1
+#define IPC_ECHO_STOP 2
+void ipc_echo_thread(void *arg);
+
+// Round trips between two kernel threads, cycles printed
+void ipc_bench(uint64_t iterations);
+// The same with pages moved there and back on every round trip, against
+// copying them both ways
+void ipc_grant_bench(uint64_t pages, uint64_t iterations);
+
+#endif // IPC_H
\ No newline at end of file
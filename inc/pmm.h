@@ -2,6 +2,7 @@
 #define PMM_H
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include <limine.h>
 
 void pmm_init(struct limine_memmap_response *map, uint64_t hhdm_offset);
@@ -9,10 +10,73 @@ void *pmm_alloc_page(void);
 void pmm_free_page(void *page);
 size_t pmm_get_free_page_count(void);
 
+// Contiguous, naturally aligned blocks of 2^order pages from the buddy allocator
+void *pmm_alloc_pages(unsigned int order);
+void pmm_free_pages(void *ptr, unsigned int order);
+
+// Boot-time cost of pmm_init, filled in once it returns
+struct pmm_init_stats {
+    uint64_t tsc_cycles;    // rdtsc delta across pmm_init
+    uint64_t pages_tracked; // Pages covered by the bitmap (up to the highest address)
+    uint64_t pages_free;    // Usable pages handed to the allocator
+    uint64_t regions;       // Usable memmap entries
+    uint64_t blocks;        // Buddy blocks the usable ranges were carved into
+    uint64_t meta_bytes;    // Bitmap, summaries, buddy maps and refcounts
+};
+
+const struct pmm_init_stats *pmm_get_init_stats(void);
+
+// Per-CPU page magazine counters
+struct pmm_pcp_stats {
+    uint64_t alloc_hits;    // pmm_alloc_page served from the magazine
+    uint64_t alloc_misses;  // Magazine was empty, refilled from the pool
+    uint64_t free_hits;     // pmm_free_page absorbed by the magazine
+    uint64_t free_drains;   // Magazine was full, drained to the pool
+    uint64_t cached;        // Pages currently in the magazine
+};
+
+void pmm_get_pcp_stats(uint32_t cpu, struct pmm_pcp_stats *out);
+
+// Give LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE memory to the allocator. Only call
+// this once nothing uses the Limine responses or the bootloader stack any more;
+// returns the number of pages gained.
+size_t pmm_reclaim_bootloader(struct limine_memmap_response *map);
+
+// A page that is already zero, from the idle-time pool when possible
+void *pmm_alloc_zeroed_page(void);
+
+// Zero one page into the pool. Called from the idle loop, returns false once
+// the pool is full (or memory ran out) so the caller can go back to sleep.
+bool pmm_zero_idle(void);
+
+struct pmm_zero_stats {
+    uint64_t depth;         // Zeroed pages ready right now
+    uint64_t hits;          // pmm_alloc_zeroed_page served from the pool
+    uint64_t misses;        // Pool was empty, page zeroed on the spot
+    uint64_t zeroed;        // Pages zeroed by the idle loop
+};
+
+void pmm_get_zero_stats(struct pmm_zero_stats *out);
+
+// Reference counts for frames mapped more than once (copy-on-write sharing).
+// A freshly allocated page has a count of 1; pmm_page_ref adds a mapping and
+// pmm_page_put drops one, freeing the page when the last one goes.
+void pmm_page_ref(void *page);
+void pmm_page_put(void *page);
+uint32_t pmm_page_refcount(void *page);
+
 #define PAGE_SIZE 4096
 #define DIV_ROUND_UP(a, b) (((a) + (b) - 1) / (b))
-#define BITMAP_SET(bit) (bitmap[(bit) / 8] |= (1 << ((bit) % 8)))
-#define BITMAP_UNSET(bit) (bitmap[(bit) / 8] &= ~(1 << ((bit) % 8)))
-#define BITMAP_TEST(bit) (bitmap[(bit) / 8] & (1 << ((bit) % 8)))
+#define PMM_MAX_ORDER 10       // Largest buddy block: 2^10 pages = 4 MiB
+#define PMM_POOL_ORDER 6       // Pool refill chunk: 64 pages, one bitmap word
+#define PMM_POOL_HIGH 256      // Pool pages kept before chunks go back to the buddy
+#define PMM_NO_PFN (~0ULL)
+#define PMM_PCP_SIZE 64        // Pages a per-CPU magazine can hold
+#define PMM_PCP_BATCH 32       // Pages moved per magazine refill/drain
+#define PMM_ZERO_POOL_SIZE 256 // Pre-zeroed pages kept around (1 MiB)
+#define PMM_RECLAIM_MAX_RANGES 64 // Reclaimable memmap entries listed on the stack
+#define BITMAP_SET(bit) (bitmap[(bit) / 64] |= (1ULL << ((bit) % 64)))
+#define BITMAP_UNSET(bit) (bitmap[(bit) / 64] &= ~(1ULL << ((bit) % 64)))
+#define BITMAP_TEST(bit) (bitmap[(bit) / 64] & (1ULL << ((bit) % 64)))
  
 #endif // PMM_H
\ No newline at end of file
@@ -0,0 +1,104 @@
+#ifndef SCHED_H
+#define SCHED_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <cpu.h>
+
+struct fpu_state;
+struct vm_space;
+struct ipc_msg;
+struct endpoint;
+
+#define IPC_HANDLES 8       // Endpoints a thread can reach from ring 3
+
+enum thread_state {
+    THREAD_RUNNING,
+    THREAD_READY,           // In a run queue
+    THREAD_BLOCKED,
+    THREAD_DEAD,
+    THREAD_IDLE,            // A CPU's idle thread, never queued
+};
+
+struct thread {
+    uint64_t rsp;           // Saved while switched out (switch.asm)
+    void *stack;            // kstack_alloc top, NULL for idle threads
+    uint32_t state;
+    uint32_t tid;
+    uint8_t priority;
+    uint32_t on_cpu;        // Some CPU is still on this stack (sched.c)
+    struct fpu_state *fpu;  // NULL: never touches the FPU outside kernel_fpu_begin
+    struct vm_space *space; // NULL: kernel thread, runs in whatever is loaded
+                            // (kernel_space after a user thread); else owned
+    void (*entry)(void *arg);
+    void *arg;
+    uint64_t user_rip;      // Where a user thread enters ring 3
+    uint64_t user_rsp;
+    const char *name;
+    struct ipc_msg *ipc_buf;    // Blocked in IPC: where the message goes
+    struct thread *ipc_caller;  // Owed a reply by this thread
+    struct thread *ipc_next;    // Endpoint wait queue
+    struct thread *run_next;    // Run queue overflow list (sched.c)
+    uint64_t ipc_window;        // Where granted pages may land in our space
+    uint64_t ipc_window_pages;
+    struct endpoint *ipc_handles[IPC_HANDLES];  // What system calls can name
+};
+
+#define SCHED_PRIORITIES 4  // 0 is the highest
+#define SCHED_HZ 100        // Timer ticks a second, a tick is the time slice
+#define RUNQ_SIZE 256       // Threads per CPU and priority, power of two
+
+// Register the timer tick and make the caller the BSP's idle thread. After
+// apic_init, before smp_init.
+void sched_init(void);
+// The same for an AP, on its own stack
+void sched_init_cpu(void);
+
+// New kernel thread, blocked until the first thread_wake
+struct thread *thread_create(const char *name, void (*entry)(void *arg), void *arg, uint8_t priority);
+// New ring 3 thread in space, entering at rip with rsp and arg in rdi. It
+// takes over space and destroys it on exit.
+struct thread *thread_create_user(const char *name, struct vm_space *space, uint64_t rip,
+                                  uint64_t rsp, uint64_t arg, uint8_t priority);
+// Free a thread that was never woken (and its space), NULL is ignored
+void thread_destroy(struct thread *t);
+__attribute__((noreturn)) void thread_exit(void);
+
+static inline struct thread *thread_current(void) {
+    struct thread *t;
+    __asm__ volatile ("mov %%gs:%c1, %0" : "=r"(t) : "i"(offsetof(struct cpu, current)));
+    return t;
+}
+
+// Give the CPU to another ready thread of the same or higher priority. Only
+// the callee-saved registers are switched.
+void yield(void);
+
+// To sleep: thread_set_blocked, check the wait condition once more, then
+// thread_block. A thread_wake in between just makes thread_block return.
+void thread_set_blocked(void);
+void thread_block(void);
+bool thread_wake(struct thread *t);     // False if t wasn't blocked
+
+// Switch away on interrupt exit if the tick or a wakeup asked for it
+void sched_preempt(void);
+
+// Hand the CPU straight to the blocked thread next, bypassing the run queues
+// and priorities. Interrupts off; the caller has usually marked itself
+// blocked already. If next was woken by someone else, just schedule().
+void sched_switch_to(struct thread *next);
+
+struct sched_stats {
+    uint64_t runnable;      // Threads in this CPU's run queues right now
+    uint64_t switches;
+    uint64_t yields;
+    uint64_t preemptions;   // Switches forced by the timer or a wakeup
+    uint64_t steals;        // Threads taken from another CPU's queues
+    uint64_t handoffs;      // Direct switches through sched_switch_to
+    uint64_t switch_cycles; // TSC cycles from schedule() until next runs, summed
+    uint64_t switch_cycles_max;
+    uint64_t ticks;
+};
+
+void sched_get_stats(uint32_t cpu, struct sched_stats *out);
+
+#endif // SCHED_H
\ No newline at end of file
@@ -0,0 +1,29 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+#include <stdint.h>
+#include <stdbool.h>
+
+// Buffered COM1 output. debug_print/debug_putc (util.h) queue into a
+// lock-free ring that any CPU or interrupt handler may write to; the UART's
+// transmit-empty interrupt (IRQ4) drains it.
+
+// Turn on the THR-empty interrupt, after idt_init and apic_init
+void serial_enable_irq(void);
+
+// Switch to synchronous output for good and flush what is queued. For
+// panics and fatal exceptions, when interrupts may never come again.
+void serial_sync(void);
+
+struct serial_stats {
+    uint64_t queued;        // Bytes accepted into the ring
+    uint64_t dropped;       // Bytes lost because the ring was full
+    uint64_t irqs;          // IRQ4s taken
+};
+
+void serial_get_stats(struct serial_stats *out);
+
+#define SERIAL_PORT 0x3F8
+#define SERIAL_RING_SIZE 8192   // Power of two
+#define SERIAL_FIFO_SIZE 16     // 16550 transmit FIFO
+
+#endif // SERIAL_H
\ No newline at end of file
@@ -0,0 +1,13 @@
+#ifndef SIMD_H
+#define SIMD_H
+#include <stdint.h>
+#include <stddef.h>
+
+// Vector kernels from src/*.simd.c. Callers must be inside
+// kernel_fpu_begin()/kernel_fpu_end(), the _avx ones only if fpu_has_avx().
+
+// Zero a 4 KiB page (64 byte aligned) with non-temporal stores
+void zero_page_sse2(void *page);
+void zero_page_avx(void *page);
+
+#endif // SIMD_H
\ No newline at end of file
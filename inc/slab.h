@@ -0,0 +1,50 @@
+#ifndef SLAB_H
+#define SLAB_H
+#include <stdint.h>
+#include <stddef.h>
+
+struct kmem_cache;
+
+// Create a cache of fixed size objects. align of 0 means 8 bytes; pass
+// KMEM_ALIGN_CACHE_LINE to keep objects from sharing cache lines.
+// ctor (may be NULL) runs once per object when its slab is created, so freed
+// objects must be handed back in their constructed state.
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *));
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+// General purpose allocations, served from power of two size classes.
+// Anything above KMALLOC_MAX_SLAB gets its own block from the buddy.
+void *kmalloc(size_t size);
+void kfree(void *ptr);
+
+void slab_init(void);
+
+struct kmem_cache_stats {
+    const char *name;
+    size_t obj_size;        // Size asked for at creation
+    size_t stride;          // Bytes each object takes in a slab
+    uint64_t slabs;
+    uint64_t objs_total;    // Object slots in all slabs
+    uint64_t objs_active;   // Handed out to callers
+    uint64_t objs_cached;   // Sitting in per-CPU free lists
+    uint64_t frag_permille; // Slab bytes not holding a live object, per mille
+};
+
+void kmem_cache_get_stats(struct kmem_cache *cache, struct kmem_cache_stats *out);
+
+// Walk all caches: pass NULL for the first one, returns NULL after the last
+struct kmem_cache *kmem_cache_next(struct kmem_cache *cache);
+
+// Print every cache's stats over serial
+void kmem_dump_stats(void);
+
+#define SLAB_ORDER 2                // Every slab is a naturally aligned 16 KiB buddy block
+#define KMALLOC_MIN_SLAB 16
+#define KMALLOC_MAX_SLAB 2048
+#define KMEM_CPU_CACHE_SIZE 16      // Objects per per-CPU free list
+#define KMEM_CPU_CACHE_BATCH 8      // Objects moved per refill/flush
+#define KMEM_MAX_EMPTY_SLABS 1      // Empty slabs a cache keeps before freeing them
+#define KMEM_ALIGN_CACHE_LINE 64
+
+#endif // SLAB_H
\ No newline at end of file
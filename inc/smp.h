@@ -0,0 +1,18 @@
+#ifndef SMP_H
+#define SMP_H
+#include <stdint.h>
+#include <cpu.h>
+
+// Point GS base at the BSP's per-CPU block. First thing in kmain, nothing
+// may call cpu_id() before it.
+void smp_init_bsp(void);
+
+// Start every AP the bootloader found and wait until all of them run on
+// their own stacks. After apic_init, before the bootloader memory is
+// reclaimed (the APs start on Limine stacks).
+void smp_init(void);
+
+uint32_t smp_cpu_count(void);           // CPUs online, BSP included
+struct cpu *smp_cpu(uint32_t id);
+
+#endif // SMP_H
\ No newline at end of file
@@ -0,0 +1,41 @@
+#ifndef SYSCALL_H
+#define SYSCALL_H
+#include <stdint.h>
+
+// System call ABI, the same through SYSCALL and through int SYSCALL_VECTOR:
+// number in rax, arguments in rdi, rsi, rdx, r10, r8, r9, result in rax.
+// Everything but rax (and rcx/r11, which SYSCALL itself uses) is preserved,
+// except that the IPC calls return the reply in the message registers.
+//
+// IPC: rdi is an endpoint handle (ipc_handle_install), the message tag is
+// in rsi and its words in rdx, r10, r8, r9.
+
+#define SYSCALL_VECTOR 0x80     // The int path, callable from ring 3
+
+#define SYS_NULL  0             // Does nothing, for measuring entry cost
+#define SYS_YIELD 1
+#define SYS_EXIT  2
+#define SYS_IPC_CALL       3    // ipc_call
+#define SYS_IPC_REPLY_WAIT 4    // ipc_reply_and_wait
+#define SYS_COUNT 5
+
+#define SYSCALL_ARGS 6
+
+#define SYSCALL_ENOSYS ((uint64_t)-1)
+
+// Program STAR/LSTAR/FMASK and enable SYSCALL on the calling CPU, after
+// gdt_init
+void syscall_init_cpu(void);
+
+// args are the six argument registers in ABI order, and a call may write
+// results back into them
+uint64_t syscall_do(uint64_t nr, uint64_t args[SYSCALL_ARGS]);
+
+// Drop to ring 3 at rip with rsp, arg in rdi. GS must be the kernel's.
+__attribute__((noreturn)) void user_enter(uint64_t rip, uint64_t rsp, uint64_t arg);
+
+// Round-trip cycles of a null call through SYSCALL and through int, timed
+// from a ring 3 thread
+void syscall_bench(uint64_t iterations);
+
+#endif // SYSCALL_H
\ No newline at end of file
@@ -8,12 +8,27 @@ void *memset(void *s, int c, size_t n);
 void *memmove(void *dest, const void *src, size_t n);
 int memcmp(const void *s1, const void *s2, size_t n);
 
+// Pick rep movsb/stosb or word loops from CPUID (ERMS/FSRM); call first thing
+void mem_init(void);
+// Whole 4 KiB pages, both pointers page aligned
+void memzero_page(void *page);
+void memcpy_page(void *dest, const void *src);
+// Print cycles for the byte, word and rep string variants, sizes 16 up to max
+void mem_bench(void *dest, const void *src, size_t max);
+
+#define MEM_REP_THRESHOLD 128   // ERMS without FSRM: shorter copies use words
+
 void hcf(void);
+// Background work, then halt until the next interrupt; never returns
+void idle_loop(void);
 
 void serial_init();
 void debug_putc(char c);
 void debug_print(const char* str);
+void debug_print_dec(uint64_t val);
+void debug_print_hex(uint64_t val);
 void outb(uint16_t port, uint8_t val);
 uint8_t inb(uint16_t port);
+uint64_t rdtsc(void);
 
 #endif // UTIL_H
\ No newline at end of file
@@ -0,0 +1,46 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Kernel virtual address allocator for the [VMALLOC_START, VMALLOC_END)
+// window. Every area is followed by an unmapped guard page, and the arena
+// starts on a page nothing maps, so each mapping is fenced on both sides.
+
+// Call after slab_init
+void vmalloc_init(void);
+
+// Virtually contiguous memory backed by single pages, NULL when out of
+// memory or address space
+void *vmalloc(size_t size);
+void vfree(void *addr);
+
+// Kernel stack of KSTACK_SIZE bytes; returns the top (initial rsp). A stack
+// overflow runs into the guard page below it and faults.
+void *kstack_alloc(void);
+void kstack_free(void *top);
+
+// Map device memory uncached. phys and size need not be page aligned, the
+// returned pointer keeps phys's offset into its page.
+void *ioremap(uint64_t phys, size_t size);
+// ioremap with a PTE_CACHE_* type, e.g. PTE_CACHE_WC for a framebuffer
+void *ioremap_cache(uint64_t phys, size_t size, uint64_t cache);
+void iounmap(void *addr);
+
+struct vmalloc_stats {
+    uint64_t areas;         // Allocated areas (vmalloc, stacks, ioremap)
+    uint64_t used_bytes;    // Address space they take, guard pages included
+    uint64_t free_ranges;   // Free ranges left after coalescing
+};
+
+void vmalloc_get_stats(struct vmalloc_stats *out);
+
+#define VMALLOC_START 0xFFFFC00000000000ULL // PML4 slots 384-447, 32 TiB
+#define VMALLOC_END   0xFFFFE00000000000ULL
+#define VMALLOC_GUARD_PAGES 1
+#define VMALLOC_BINS 64             // Free lists by log2 of the size in pages
+#define VMALLOC_HASH_BITS 10        // 1024 buckets for the address lookups
+#define KSTACK_SIZE (4 * 4096)
+
+#endif // VMALLOC_H
\ No newline at end of file
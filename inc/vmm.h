@@ -2,9 +2,12 @@
 #define VMM_H
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include <limine.h>
+#include <spinlock.h>
 
 typedef uint64_t pml4_t;
+struct tlb_batch;
 
 // Initialize VMM, create the Kernel PML4, and switch CR3
 void vmm_init(struct limine_memmap_response *map); 
@@ -12,12 +15,72 @@ void vmm_init(struct limine_memmap_response *map);
 // Map a specific virtual address to a physical address
 void vmm_map_page(pml4_t *pml4, uint64_t virt, uint64_t phys, uint64_t flags);
 
+// Map/unmap len bytes of consecutive pages. The page table is walked once per
+// 2 MiB and TLB invalidations are flushed together at the end.
+void vmm_map_range(pml4_t *pml4, uint64_t virt, uint64_t phys, uint64_t len, uint64_t flags);
+void vmm_unmap_range(pml4_t *pml4, uint64_t virt, uint64_t len);
+// vmm_unmap_range that also frees the frames that were mapped there
+void vmm_release_range(pml4_t *pml4, uint64_t virt, uint64_t len);
+// The same into batch->pml4 for a caller holding lock, which flushes the
+// batch once it has dropped the lock. Flushes needed on the way drop it too.
+void vmm_release_range_locked(struct tlb_batch *batch, uint64_t virt, uint64_t len, spinlock_t *lock);
+
+// Tear down a user address space (see vmm.c)
+void vmm_destroy_pml4(pml4_t *pml4);
+
+// Copy-on-write clone of the user half of pml4 (see vmm.c). The parent's
+// entries that lost write access go into batch (for pml4), which the caller
+// must flush, after dropping its locks.
+pml4_t *vmm_clone(pml4_t *pml4, struct tlb_batch *batch);
+
+// Leaf PTE for virt, NULL if no page table covers it. Callers that change
+// a present entry must follow up with vmm_invalidate_page (or a batch),
+// which interrupts other CPUs, so not while holding a lock they may want.
+uint64_t *vmm_get_pte(pml4_t *pml4, uint64_t virt);
+void vmm_invalidate_page(pml4_t *pml4, uint64_t virt);
+
+// Is pml4 loaded in CR3 on this CPU?
+bool vmm_is_active(pml4_t *pml4);
+
 // Unmap a page (mostly for cleanup)
 void vmm_unmap_page(pml4_t *pml4, uint64_t virt);
 
 // Switch the CPU to a new Address Space (Load CR3)
+// With PCID support each PML4 gets a tag, and switching back to a space
+// whose tag is still valid on this CPU keeps its TLB entries.
 void vmm_switch_pml4(pml4_t *pml4);
 
+// Load the kernel PML4, program the PAT and turn on CR0.WP, CR4.PGE (and
+// CR4.PCIDE when supported) on the calling CPU.
+// vmm_init does this for the BSP; every AP calls it first thing.
+void vmm_init_cpu(void);
+
+
+// Pending TLB invalidations for one address space
+#define TLB_BATCH_MAX 32    // More pages than this and a CR3 reload is cheaper
+
+#define TLB_BATCH_MAX_FREES 16  // Pages waiting for the flush before they're freed
+
+struct tlb_batch {
+    pml4_t *pml4;
+    uint32_t count;
+    bool full_flush;
+    uint64_t addrs[TLB_BATCH_MAX];
+    // Unmapped frames and emptied page tables, only freed once no TLB or
+    // paging-structure cache can still point at them
+    uint32_t free_count;
+    uint64_t frees[TLB_BATCH_MAX_FREES];
+};
+
+void tlb_batch_init(struct tlb_batch *batch, pml4_t *pml4);
+void tlb_batch_add(struct tlb_batch *batch, uint64_t virt);
+// Flush here and, with an IPI, on every other CPU that may cache the entries
+void tlb_batch_flush(struct tlb_batch *batch);
+// Drop a reference to a page (physical address) once the batch has been flushed
+void tlb_batch_defer_free(struct tlb_batch *batch, uint64_t phys);
+// Flushes that had to interrupt other CPUs
+uint64_t tlb_shootdown_count(void);
+
 
 // Intel x64 Page Table Flags
 #define PTE_PRESENT   (1ULL << 0)
@@ -29,13 +92,44 @@ void vmm_switch_pml4(pml4_t *pml4);
 #define PTE_DIRTY     (1ULL << 6)
 #define PTE_HUGE      (1ULL << 7) // For 2MB/1GB pages
 #define PTE_GLOBAL    (1ULL << 8)
+#define PTE_COW       (1ULL << 9) // Software bit: read-only until a write fault copies it
+#define PTE_PAT       (1ULL << 7) // 4 KiB pages only, huge pages keep it in bit 12
+#define PTE_PAT_HUGE  (1ULL << 12)
 // #define PTE_NX        (1ULL << 63) // No Execute
 #define PTE_NX 0
 
+// Cache types, as flags for the mapping calls. vmm_init_cpu programs the PAT
+// so entries 0-3 keep their power-on meaning and entry 4 is write-combining.
+#define PTE_CACHE_WB  0                     // Normal memory
+#define PTE_CACHE_WT  PTE_PWT
+#define PTE_CACHE_UC  (PTE_PCD | PTE_PWT)   // MMIO registers
+#define PTE_CACHE_WC  PTE_PAT               // Framebuffers
+#define PTE_CACHE_MASK (PTE_PAT | PTE_PCD | PTE_PWT)
+
+#define PAT_UC  0x00
+#define PAT_WC  0x01
+#define PAT_WT  0x04
+#define PAT_WP  0x05
+#define PAT_WB  0x06
+#define PAT_UCM 0x07    // UC-, MTRRs may still make it WC
+#define PAT_ENTRY(index, type) ((uint64_t)(type) << ((index) * 8))
+
+#define PAGE_SIZE_2M (1ULL << 21)
+#define PAGE_SIZE_1G (1ULL << 30)
+
+#define USER_SPACE_END     0x0000800000000000ULL
+// Ring 3 never maps the last page: a SYSCALL at its very end would return
+// to a non-canonical RIP, which SYSRET faults on in ring 0
+#define USER_MAP_END       (USER_SPACE_END - 0x1000)
+#define KERNEL_SPACE_START 0xFFFF800000000000ULL
+
 // Align an address down/up to the nearest 4096 bytes
 #define ALIGN_DOWN(addr) ((addr) & ~(0xFFF))
 #define ALIGN_UP(addr)   (((addr) + 0xFFF) & ~(0xFFF))
 
+#define CR3_NOFLUSH (1ULL << 63) // With PCIDs: keep the new PCID's TLB entries
+#define PCID_SLOTS  256          // PCIDs handed out (0 is the kernel PML4)
+
 #define PHYS_ADDR_MASK 0x000FFFFFFFFFF000ULL // Mask to get physical address from page table entry
 
 #endif // VMM_H
\ No newline at end of file
@@ -0,0 +1,63 @@
+#ifndef VMSPACE_H
+#define VMSPACE_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <vmm.h>
+#include <spinlock.h>
+
+// A reserved range of virtual memory. Pages are only allocated and mapped
+// when they are first touched, by the page fault handler.
+struct vm_region {
+    uint64_t start;
+    uint64_t end;
+    uint64_t pte_flags;         // Flags the pages get once faulted in
+    struct vm_region *next;     // Sorted by start
+};
+
+// An address space: its page tables and the regions that may fault in
+struct vm_space {
+    pml4_t *pml4;
+    spinlock_t lock;
+    struct vm_region *regions;
+};
+
+extern struct vm_space kernel_space;
+
+// Set up kernel_space around the kernel PML4; call after vmm_init and slab_init
+void vmspace_init(void);
+
+// New address space sharing the kernel half of kernel_space
+struct vm_space *vmspace_create(void);
+// Free the user half: every mapped frame, page table, region and the PML4
+void vmspace_destroy(struct vm_space *space);
+// Copy-on-write copy of space with the same regions, NULL when out of memory
+struct vm_space *vmspace_clone(struct vm_space *space);
+
+void vmspace_switch(struct vm_space *space);
+struct vm_space *vmspace_current(void);
+
+// Reserve [start, start + len) for demand-zero memory. Fails on overlap.
+bool vm_region_add(struct vm_space *space, uint64_t start, uint64_t len, uint64_t pte_flags);
+// Drop the region starting at start and free whatever got faulted in
+void vm_region_remove(struct vm_space *space, uint64_t start);
+
+// Hand pages [src, src + pages * PAGE_SIZE) of from to the same range at
+// dst in to, which must be unmapped. move unmaps them from from (one batched
+// TLB shootdown); otherwise both map the same frames. Every source page
+// must be present and user accessible, and shared pages can't be
+// copy-on-write. Nothing changes on failure.
+bool vmspace_grant(struct vm_space *from, uint64_t src, struct vm_space *to, uint64_t dst,
+                   uint64_t pages, bool move);
+
+// Called for #PF. Returns true if the fault was resolved.
+bool vmspace_handle_fault(uint64_t addr, uint64_t err_code);
+
+// #PF error code bits
+#define PF_PRESENT (1 << 0)     // Protection violation (page was present)
+#define PF_WRITE   (1 << 1)
+#define PF_USER    (1 << 2)
+#define PF_RSVD    (1 << 3)
+#define PF_FETCH   (1 << 4)
+
+#endif // VMSPACE_H
\ No newline at end of file
@@ -0,0 +1,41 @@
+#ifndef WORK_H
+#define WORK_H
+#include <stdint.h>
+#include <stdbool.h>
+
+// Deferred interrupt work (bottom halves). A hard-IRQ handler only acks its
+// device and queues a work item; the item runs later on the same CPU with
+// interrupts enabled, on the way out of the interrupt or from the idle loop.
+
+struct work {
+    void (*fn)(void *ctx);
+    void *ctx;
+    struct work *next;      // Owned by the queue while pending
+    bool pending;
+};
+
+#define WORK_INIT(func, arg) { .fn = (func), .ctx = (arg) }
+
+// Queue w on the calling CPU (or on cpu). Lock-free, safe from any context.
+// False if w is already queued; it then still runs just once.
+bool work_queue(struct work *w);
+bool work_queue_on(uint32_t cpu, struct work *w);
+
+// Run this CPU's queue in batches, interrupts on while the items run. Call
+// with interrupts off; returns with them off. Nested calls return at once.
+void work_run(void);
+
+// Items are waiting on this CPU
+bool work_pending(void);
+
+struct work_stats {
+    uint64_t queued;        // Items queued, all CPUs
+    uint64_t ran;           // Items run
+    uint64_t deferred;      // Times the batch limit left work for the idle loop
+};
+
+void work_get_stats(struct work_stats *out);
+
+#define WORK_MAX_BATCHES 4  // Queue swaps per work_run before giving up
+
+#endif // WORK_H
\ No newline at end of file
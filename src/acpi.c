@@ -0,0 +1,80 @@
+#include <acpi.h>
+#include <vmalloc.h>
+#include <vmm.h>
+#include <limine.h>
+#include <util.h>
+
+extern uint64_t hhdm_offset;
+
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_rsdp_request rsdp_request = {
+    .id = LIMINE_RSDP_REQUEST_ID,
+    .revision = 0
+};
+
+struct acpi_rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;       // 0 for ACPI 1.0 (RSDT only), 2+ has the XSDT
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed));
+
+// Firmware tables live outside the HHDM (only RAM is mapped there)
+static struct acpi_header *map_table(uint64_t phys){
+    struct acpi_header *header = ioremap_cache(phys, sizeof(struct acpi_header), PTE_CACHE_WB);
+    if(!header) return NULL;
+
+    uint32_t length = header->length;
+    iounmap(header);
+
+    return ioremap_cache(phys, length, PTE_CACHE_WB);
+}
+
+struct acpi_header *acpi_map_table(const char *signature){
+    if(rsdp_request.response == NULL) return NULL;
+
+    // a physical address with base revision 3+, older ones gave an HHDM one
+    uint64_t rsdp_phys = (uint64_t)rsdp_request.response->address;
+    if(rsdp_phys >= hhdm_offset) rsdp_phys -= hhdm_offset;
+
+    struct acpi_rsdp *rsdp = ioremap_cache(rsdp_phys, sizeof(struct acpi_rsdp), PTE_CACHE_WB);
+    if(!rsdp) return NULL;
+
+    bool xsdt = rsdp->revision >= 2 && rsdp->xsdt_address != 0;
+    uint64_t root_phys = xsdt ? rsdp->xsdt_address : rsdp->rsdt_address;
+    iounmap(rsdp);
+
+    struct acpi_header *root = map_table(root_phys);
+    if(!root) return NULL;
+
+    // the XSDT holds 64-bit pointers, the RSDT 32-bit ones
+    size_t entry_size = xsdt ? 8 : 4;
+    size_t entries = (root->length - sizeof(struct acpi_header)) / entry_size;
+    uint8_t *pointers = (uint8_t*)root + sizeof(struct acpi_header);
+
+    struct acpi_header *found = NULL;
+    for(size_t i = 0; i < entries && !found; i++){
+        uint64_t phys = 0;
+        memcpy(&phys, pointers + i * entry_size, entry_size);
+
+        // only the header until the signature matches
+        struct acpi_header *header = ioremap_cache(phys, sizeof(struct acpi_header), PTE_CACHE_WB);
+        if(!header) continue;
+        bool match = memcmp(header->signature, signature, 4) == 0;
+        iounmap(header);
+
+        if(match) found = map_table(phys);
+    }
+
+    iounmap(root);
+    return found;
+}
+
+void acpi_unmap_table(struct acpi_header *table){
+    iounmap(table);
+}
\ No newline at end of file
@@ -0,0 +1,338 @@
+#include <apic.h>
+#include <acpi.h>
+#include <idt.h>
+#include <cpu.h>
+#include <vmalloc.h>
+#include <vmm.h>
+#include <pmm.h>
+#include <util.h>
+
+struct madt {
+    struct acpi_header header;
+    uint32_t lapic_address;
+    uint32_t flags;         // Bit 0: there is an 8259 to disable
+    uint8_t entries[];
+} __attribute__((packed));
+
+#define MADT_PCAT_COMPAT 1
+
+#define MADT_IOAPIC          1
+#define MADT_ISO             2
+#define MADT_LAPIC_OVERRIDE  5
+
+struct madt_entry {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct madt_ioapic {
+    struct madt_entry entry;
+    uint8_t id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+} __attribute__((packed));
+
+// Interrupt source override: ISA line "source" is wired to "gsi"
+struct madt_iso {
+    struct madt_entry entry;
+    uint8_t bus;
+    uint8_t source;
+    uint32_t gsi;
+    uint16_t flags;         // MPS INTI flags, see ISO_*
+} __attribute__((packed));
+
+struct madt_lapic_override {
+    struct madt_entry entry;
+    uint16_t reserved;
+    uint64_t address;
+} __attribute__((packed));
+
+#define ISO_ACTIVE_LOW(f)    (((f) & 3) == 3)
+#define ISO_LEVEL(f)         ((((f) >> 2) & 3) == 3)
+
+#define IOAPIC_REGSEL   0x00
+#define IOAPIC_WINDOW   0x10
+#define IOAPIC_VER      0x01
+#define IOAPIC_REDTBL(n) (0x10 + 2 * (n))
+
+#define REDTBL_ACTIVE_LOW (1 << 13)
+#define REDTBL_LEVEL      (1 << 15)
+#define REDTBL_MASKED     (1 << 16)
+
+#define X2APIC_MSR_BASE 0x800
+
+#define TIMER_DIV_16 0x3
+
+// PIT channel 2, gated through port 0x61, is the calibration reference
+#define PIT_HZ        1193182
+#define PIT_CMD       0x43
+#define PIT_CH2       0x42
+#define PIT_GATE_PORT 0x61
+#define PIT_GATE      0x01
+#define PIT_SPEAKER   0x02
+#define PIT_OUT2      0x20
+#define CALIBRATE_MS  10
+
+struct ioapic {
+    volatile uint32_t *regs;
+    uint32_t gsi_base;
+    uint32_t gsi_count;
+};
+
+static struct ioapic ioapics[IOAPIC_MAX];
+static uint32_t ioapic_count = 0;
+
+// Where each ISA IRQ ends up, identity unless the MADT overrides it
+static uint32_t isa_gsi[16];
+static uint16_t isa_flags[16];
+
+static bool apic_enabled = false;      // The local APIC is up
+static bool ioapic_routing = false;    // ISA IRQs go through the IOAPIC
+static bool x2apic = false;
+static uint64_t lapic_phys;
+static volatile uint32_t *lapic_mmio;
+static uint32_t bsp_apic_id;
+static uint32_t timer_ticks_per_ms = 0;  // At divide-by-16, same on every CPU
+
+static inline uint32_t lapic_read(uint32_t reg){
+    if(x2apic) return (uint32_t)rdmsr(X2APIC_MSR_BASE + reg / 16);
+    return lapic_mmio[reg / 4];
+}
+
+// In x2APIC mode this is a single WRMSR, no uncached MMIO round trip
+static inline void lapic_write(uint32_t reg, uint32_t value){
+    if(x2apic) wrmsr(X2APIC_MSR_BASE + reg / 16, value);
+    else lapic_mmio[reg / 4] = value;
+}
+
+static uint32_t ioapic_read(struct ioapic *io, uint32_t reg){
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    return io->regs[IOAPIC_WINDOW / 4];
+}
+
+static void ioapic_write(struct ioapic *io, uint32_t reg, uint32_t value){
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    io->regs[IOAPIC_WINDOW / 4] = value;
+}
+
+static void add_ioapic(struct madt_ioapic *entry){
+    if(ioapic_count == IOAPIC_MAX) return;
+
+    struct ioapic *io = &ioapics[ioapic_count];
+    io->regs = ioremap(entry->address, PAGE_SIZE);
+    if(!io->regs) return;
+
+    io->gsi_base = entry->gsi_base;
+    io->gsi_count = ((ioapic_read(io, IOAPIC_VER) >> 16) & 0xFF) + 1;
+
+    // nothing is routed until irq_enable asks for it
+    for(uint32_t i = 0; i < io->gsi_count; i++){
+        ioapic_write(io, IOAPIC_REDTBL(i), REDTBL_MASKED);
+    }
+    ioapic_count++;
+}
+
+static struct ioapic *ioapic_for(uint32_t gsi){
+    for(uint32_t i = 0; i < ioapic_count; i++){
+        if(gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].gsi_count){
+            return &ioapics[i];
+        }
+    }
+    return NULL;
+}
+
+// Count the local APIC timer down for CALIBRATE_MS as timed by the PIT
+static void timer_calibrate(void){
+    uint8_t gate = (inb(PIT_GATE_PORT) & ~PIT_SPEAKER) & ~PIT_GATE;
+    outb(PIT_GATE_PORT, gate);
+
+    // mode 0: OUT2 goes high once the count runs out
+    uint16_t count = PIT_HZ / 1000 * CALIBRATE_MS;
+    outb(PIT_CMD, 0xB0);        // Channel 2, lo/hi byte, mode 0
+    outb(PIT_CH2, count & 0xFF);
+    outb(PIT_CH2, count >> 8);
+
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+
+    outb(PIT_GATE_PORT, gate | PIT_GATE);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    while(!(inb(PIT_GATE_PORT) & PIT_OUT2)){ }
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+
+    lapic_write(LAPIC_TIMER_INIT, 0);
+    outb(PIT_GATE_PORT, gate);
+
+    timer_ticks_per_ms = elapsed / CALIBRATE_MS;
+}
+
+bool apic_timer_start(uint32_t hz){
+    if(!apic_enabled || timer_ticks_per_ms == 0) return false;
+
+    lapic_write(LAPIC_TIMER_DIV, TIMER_DIV_16);
+    lapic_write(LAPIC_LVT_TIMER, APIC_TIMER_VECTOR | LAPIC_TIMER_PERIODIC);
+    lapic_write(LAPIC_TIMER_INIT, timer_ticks_per_ms * 1000 / hz);
+    return true;
+}
+
+// IOAPICs and ISA overrides, and where the local APIC really is
+static void parse_madt(struct madt *madt){
+    lapic_phys = madt->lapic_address;
+
+    uint8_t *p = madt->entries;
+    uint8_t *end = (uint8_t*)madt + madt->header.length;
+    while(p + sizeof(struct madt_entry) <= end){
+        struct madt_entry *entry = (struct madt_entry*)p;
+        if(entry->length < sizeof(struct madt_entry) || p + entry->length > end) break;
+
+        if(entry->type == MADT_IOAPIC){
+            add_ioapic((struct madt_ioapic*)p);
+        } else if(entry->type == MADT_ISO){
+            struct madt_iso *iso = (struct madt_iso*)p;
+            if(iso->source < 16){
+                isa_gsi[iso->source] = iso->gsi;
+                isa_flags[iso->source] = iso->flags;
+            }
+        } else if(entry->type == MADT_LAPIC_OVERRIDE){
+            lapic_phys = ((struct madt_lapic_override*)p)->address;
+        }
+        p += entry->length;
+    }
+}
+
+void apic_init(void){
+    for(int i = 0; i < 16; i++){
+        isa_gsi[i] = i;
+        isa_flags[i] = 0;   // ISA default: active high, edge
+    }
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if(!(edx & CPUID_APIC)){
+        debug_print("No local APIC, staying on the 8259\n");
+        return;
+    }
+    x2apic = ecx & CPUID_X2APIC;
+    lapic_phys = rdmsr(MSR_APIC_BASE) & APIC_BASE_ADDR_MASK;
+
+    // the MADT only adds the IOAPICs, the local APIC is there regardless and
+    // IPIs and the timer need it
+    struct madt *madt = (struct madt*)acpi_map_table("APIC");
+    if(madt){
+        parse_madt(madt);
+        acpi_unmap_table(&madt->header);
+    }
+
+    if(ioapic_count == 0){
+        debug_print(madt ? "No IOAPIC" : "No MADT");
+        debug_print(", ISA IRQs stay on the 8259\n");
+    } else {
+        // mask the 8259 whatever MADT_PCAT_COMPAT says, firmware may have
+        // left it unmasked without setting the flag, and writing the mask
+        // ports is harmless when there is none. idt_init remapped it to
+        // 32-47, so a spurious IRQ7/15 stays harmless too.
+        pic_disable();
+        ioapic_routing = true;
+    }
+
+    if(!x2apic){
+        lapic_mmio = ioremap(lapic_phys, PAGE_SIZE);
+        if(!lapic_mmio){
+            debug_print("Failed to map the local APIC\n");
+            hcf();
+        }
+    }
+
+    apic_enabled = true;
+    apic_init_cpu();
+    bsp_apic_id = apic_id();
+
+    // the 8259 reaches the BSP through LINT0 in virtual wire mode
+    if(!ioapic_routing){
+        lapic_write(LAPIC_LVT_LINT0, LAPIC_DELIVERY_EXTINT);
+    }
+    timer_calibrate();
+
+    debug_print(x2apic ? "x2APIC" : "xAPIC");
+    debug_print(" enabled, IOAPICs: ");
+    debug_print_dec(ioapic_count);
+    debug_print(", timer ");
+    debug_print_dec(timer_ticks_per_ms);
+    debug_print(" ticks/ms\n");
+}
+
+void apic_init_cpu(void){
+    if(!apic_enabled) return;
+
+    // x2APIC can only be entered from an enabled xAPIC
+    uint64_t base = rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE;
+    wrmsr(MSR_APIC_BASE, base);
+    if(x2apic) wrmsr(MSR_APIC_BASE, base | APIC_BASE_X2APIC);
+
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+bool apic_present(void){
+    return apic_enabled;
+}
+
+uint32_t apic_id(void){
+    if(!apic_enabled) return 0;
+    if(x2apic) return lapic_read(LAPIC_ID);
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void irq_enable(uint8_t irq){
+    if(!ioapic_routing){
+        pic_unmask(irq);
+        return;
+    }
+    if(irq >= 16) return;
+
+    uint32_t gsi = isa_gsi[irq];
+    struct ioapic *io = ioapic_for(gsi);
+    if(!io){
+        debug_print("No IOAPIC for IRQ ");
+        debug_print_dec(irq);
+        debug_print("\n");
+        return;
+    }
+
+    uint32_t low = IRQ_VECTOR_BASE + irq;   // Fixed delivery, physical destination
+    if(ISO_ACTIVE_LOW(isa_flags[irq])) low |= REDTBL_ACTIVE_LOW;
+    if(ISO_LEVEL(isa_flags[irq])) low |= REDTBL_LEVEL;
+
+    // destination first, the entry goes live when the low half unmasks it
+    uint32_t entry = gsi - io->gsi_base;
+    ioapic_write(io, IOAPIC_REDTBL(entry) + 1, bsp_apic_id << 24);
+    ioapic_write(io, IOAPIC_REDTBL(entry), low);
+}
+
+void irq_eoi(uint8_t vector){
+    // the 8259's IRQs want its EOI even with the local APIC up
+    uint8_t irq = vector - IRQ_VECTOR_BASE;
+    if(!apic_enabled || (!ioapic_routing && irq < 16)){
+        pic_eoi(irq);
+    } else {
+        lapic_write(LAPIC_EOI, 0);
+    }
+}
+
+void apic_send_ipi(uint32_t dest, uint8_t vector){
+    if(!apic_enabled) return;
+
+    // x2APIC: one 64-bit ICR write, destination in the high half
+    if(x2apic){
+        wrmsr(X2APIC_MSR_BASE + LAPIC_ICR_LOW / 16, ((uint64_t)dest << 32) | vector);
+        return;
+    }
+
+    // the write to the low half sends it, don't overwrite a pending one
+    while(lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING){
+        cpu_relax();
+    }
+    lapic_write(LAPIC_ICR_HIGH, dest << 24);
+    lapic_write(LAPIC_ICR_LOW, vector);     // Fixed, physical, no shorthand
+}
\ No newline at end of file
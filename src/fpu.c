@@ -0,0 +1,194 @@
+#include <fpu.h>
+#include <cpu.h>
+#include <slab.h>
+#include <util.h>
+
+struct fpu_state {
+    uint32_t last_cpu;      // CPU whose registers were last loaded from area
+    // FXSAVE region, then with XSAVE the header and extended components,
+    // fpu_size bytes in all
+    uint8_t area[] __attribute__((aligned(64)));
+};
+
+#define FPU_NO_CPU (~0U)
+
+#define XCR0_X87 (1ULL << 0)
+#define XCR0_SSE (1ULL << 1)
+#define XCR0_AVX (1ULL << 2)
+
+#define FXSAVE_FCW   0      // Offsets into the legacy region
+#define FXSAVE_MXCSR 24
+
+static bool use_xsave = false;
+static bool use_xsaveopt = false;
+static bool have_avx = false;
+static uint32_t fpu_size = 512;
+static struct kmem_cache *fpu_cache = NULL;
+
+// Whose registers are loaded on each CPU, and whose should be. They differ
+// after a lazy switch until the new thread touches the FPU.
+//
+// CR0.TS clear means the registers may be newer than owner's area. TS is set
+// on every switch, after saving the outgoing thread if it used the FPU, so
+// with TS set every area is up to date and a thread can resume anywhere.
+static struct fpu_state *fpu_owner[MAX_CPUS];
+static struct fpu_state *fpu_current[MAX_CPUS];
+static uint64_t kernel_fpu_flags[MAX_CPUS];
+
+static inline void clts(void){
+    __asm__ volatile("clts" ::: "memory");
+}
+
+static inline void stts(void){
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+static inline void xsetbv(uint32_t reg, uint64_t value){
+    __asm__ volatile("xsetbv" :: "c"(reg), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline bool fpu_dirty(void){
+    return !(read_cr0() & CR0_TS);
+}
+
+static void fpu_save(struct fpu_state *state){
+    // XSAVEOPT skips components that are unchanged since the XRSTOR
+    if(use_xsaveopt){
+        __asm__ volatile("xsaveopt64 (%0)" :: "r"(state->area), "a"(~0U), "d"(~0U) : "memory");
+    } else if(use_xsave){
+        __asm__ volatile("xsave64 (%0)" :: "r"(state->area), "a"(~0U), "d"(~0U) : "memory");
+    } else {
+        __asm__ volatile("fxsave64 (%0)" :: "r"(state->area) : "memory");
+    }
+}
+
+static void fpu_restore(struct fpu_state *state){
+    if(use_xsave){
+        __asm__ volatile("xrstor64 (%0)" :: "r"(state->area), "a"(~0U), "d"(~0U) : "memory");
+    } else {
+        __asm__ volatile("fxrstor64 (%0)" :: "r"(state->area) : "memory");
+    }
+}
+
+void fpu_init(void){
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    bool xsave = (ecx >> 26) & 1;
+    bool avx = (ecx >> 28) & 1;
+
+    // native x87 errors, no emulation, TS makes wait/fwait trap too
+    uint64_t cr0 = (read_cr0() & ~CR0_EM) | CR0_MP | CR0_NE;
+    write_cr0(cr0);
+
+    uint64_t cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if(xsave) cr4 |= CR4_OSXSAVE;
+    write_cr4(cr4);
+
+    if(xsave){
+        uint64_t xcr0 = XCR0_X87 | XCR0_SSE;
+        if(avx) xcr0 |= XCR0_AVX;
+        xsetbv(0, xcr0);
+    }
+
+    // the BSP sizes the state for everyone, all CPUs must match it
+    if(fpu_cache == NULL){
+        use_xsave = xsave;
+        have_avx = xsave && avx;
+
+        if(xsave){
+            cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+            fpu_size = ebx;     // Bytes for the components enabled in XCR0
+            cpuid(0xD, 1, &eax, &ebx, &ecx, &edx);
+            use_xsaveopt = eax & 1;
+        }
+
+        fpu_cache = kmem_cache_create("fpu_state", sizeof(struct fpu_state) + fpu_size, 64, NULL);
+        if(!fpu_cache) hcf();
+    }
+
+    stts();
+}
+
+bool fpu_ready(void){
+    return fpu_cache != NULL;
+}
+
+bool fpu_has_avx(void){
+    return have_avx;
+}
+
+void kernel_fpu_begin(void){
+    uint64_t flags = irq_save();
+    uint32_t cpu = cpu_id();
+
+    // write back the thread's live registers, #NM reloads them later
+    if(fpu_owner[cpu] && fpu_dirty()){
+        fpu_save(fpu_owner[cpu]);
+    }
+    fpu_owner[cpu] = NULL;
+
+    clts();
+    kernel_fpu_flags[cpu] = flags;
+}
+
+void kernel_fpu_end(void){
+    uint32_t cpu = cpu_id();
+
+    stts();
+    irq_restore(kernel_fpu_flags[cpu]);
+}
+
+struct fpu_state *fpu_state_alloc(void){
+    struct fpu_state *state = kmem_cache_alloc(fpu_cache);
+    if(!state) return NULL;
+
+    // XSTATE_BV of 0 in the header makes XRSTOR load the init state for
+    // every component, only the control words have to be valid
+    state->last_cpu = FPU_NO_CPU;
+    memset(state->area, 0, fpu_size);
+    *(uint16_t*)&state->area[FXSAVE_FCW] = 0x037F;
+    *(uint32_t*)&state->area[FXSAVE_MXCSR] = 0x1F80;
+
+    return state;
+}
+
+// With TS set on every switch nothing saves into an owner that isn't
+// running, so a stale fpu_owner entry is harmless
+void fpu_state_free(struct fpu_state *state){
+    kmem_cache_free(fpu_cache, state);
+}
+
+// Call on every context switch with interrupts off, before running next
+void fpu_switch(struct fpu_state *next){
+    uint32_t cpu = cpu_id();
+
+    if(fpu_owner[cpu] && fpu_dirty()){
+        fpu_save(fpu_owner[cpu]);
+    }
+
+    fpu_current[cpu] = next;
+
+    // the registers still hold next's state if nothing ran on them since,
+    // here or, after a migration, anywhere else
+    if(next && fpu_owner[cpu] == next && next->last_cpu == cpu){
+        clts();
+    } else {
+        stts();
+    }
+}
+
+bool fpu_handle_nm(void){
+    uint32_t cpu = cpu_id();
+    struct fpu_state *current = fpu_current[cpu];
+
+    // kernel code outside kernel_fpu_begin/end, or a thread without state
+    if(current == NULL) return false;
+
+    // TS was set, so whatever the registers held is already saved
+    clts();
+    fpu_restore(current);
+    fpu_owner[cpu] = current;
+    current->last_cpu = cpu;
+
+    return true;
+}
\ No newline at end of file
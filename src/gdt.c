@@ -1,20 +1,26 @@
 #include <gdt.h>
 #include <vmm.h>
 #include <util.h>
+#include <cpu.h>
 
 // Global Descriptor Table
 // 0: Null
 // 1: Kernel Code
 // 2: Kernel Data
-// 3: User Code
-// 4: User Data
+// 3: User Data
+// 4: User Code
 // 5: TSS (Takes up 2 slots)
-static struct gdt_entry gdt[7]; 
-static struct tss_entry tss;
-static struct gdtr gdtr;
+// User data sits right below user code because SYSRET loads SS and CS from
+// STAR[63:48] + 8 and + 16 (see syscall.c).
+// One of each per CPU: the TSS descriptor goes busy on LTR, so it can't be
+// shared, and each CPU needs its own rsp0.
+#define GDT_ENTRIES 7
+static struct gdt_entry gdts[MAX_CPUS][GDT_ENTRIES];
+static struct tss_entry tsss[MAX_CPUS];
+static struct gdtr gdtrs[MAX_CPUS];
 
 // Helper to fill entries
-static void gdt_set_gate(int num, uint64_t base, uint64_t limit, uint8_t access, uint8_t gran) {
+static void gdt_set_gate(struct gdt_entry *gdt, int num, uint64_t base, uint64_t limit, uint8_t access, uint8_t gran) {
     gdt[num].base_low    = (base & 0xFFFF);
     gdt[num].base_middle = (base >> 16) & 0xFF;
     gdt[num].base_high   = (base >> 24) & 0xFF;
@@ -27,8 +33,8 @@ static void gdt_set_gate(int num, uint64_t base, uint64_t limit, uint8_t access,
 }
 
 // Helper for the 16-byte TSS descriptor
-static void gdt_set_system_gate(int num, uint64_t base, uint64_t limit, uint8_t access, uint8_t gran) {
-    gdt_set_gate(num, base, limit, access, gran);
+static void gdt_set_system_gate(struct gdt_entry *gdt, int num, uint64_t base, uint64_t limit, uint8_t access, uint8_t gran) {
+    gdt_set_gate(gdt, num, base, limit, access, gran);
     
     // Cast to the larger struct to write the upper 32 bits
     struct gdt_system_entry *desc = (struct gdt_system_entry *)&gdt[num];
@@ -41,44 +47,48 @@ extern void load_gdt(struct gdtr *gdtr);
 extern void load_tss(void);
 
 void gdt_init(void) {
+    struct gdt_entry *gdt = gdts[cpu_id()];
+    struct tss_entry *tss = &tsss[cpu_id()];
+    struct gdtr *gdtr = &gdtrs[cpu_id()];
+
     // 1. Setup the TSS (Task State Segment)
     // We can leave most of it zero for now, but rsp0 is critical later.
-    memset(&tss, 0, sizeof(struct tss_entry));
-    tss.iomap_base = sizeof(struct tss_entry); // Disable IO Map
+    memset(tss, 0, sizeof(struct tss_entry));
+    tss->iomap_base = sizeof(struct tss_entry); // Disable IO Map
 
     // 2. Setup GDT Entries
     // NULL Descriptor
-    gdt_set_gate(0, 0, 0, 0, 0);
+    gdt_set_gate(gdt, 0, 0, 0, 0, 0);
 
     // Kernel Code (0x08) - Access: 0x9A, Gran: 0x20 (Long Mode)
     // Present | Priv 0 | Code | Ex | Readable
-    gdt_set_gate(1, 0, 0, 0x9A, 0x20);
+    gdt_set_gate(gdt, 1, 0, 0, 0x9A, 0x20);
 
     // Kernel Data (0x10) - Access: 0x92
     // Present | Priv 0 | Data | RW
-    gdt_set_gate(2, 0, 0, 0x92, 0);
-
-    // User Code (0x18) - Access: 0xFA
-    // Present | Priv 3 | Code | Ex | Readable
-    gdt_set_gate(3, 0, 0, 0xFA, 0x20);
+    gdt_set_gate(gdt, 2, 0, 0, 0x92, 0);
 
-    // User Data (0x20) - Access: 0xF2
+    // User Data (0x18) - Access: 0xF2
     // Present | Priv 3 | Data | RW
-    gdt_set_gate(4, 0, 0, 0xF2, 0);
+    gdt_set_gate(gdt, 3, 0, 0, 0xF2, 0);
+
+    // User Code (0x20) - Access: 0xFA
+    // Present | Priv 3 | Code | Ex | Readable
+    gdt_set_gate(gdt, 4, 0, 0, 0xFA, 0x20);
 
     // TSS (0x28) - System Segment
     // Base = &tss, Limit = sizeof(tss), Access = 0x89 (Present|Exec|Accessed)
-    gdt_set_system_gate(5, (uint64_t)&tss, sizeof(struct tss_entry) - 1, 0x89, 0);
+    gdt_set_system_gate(gdt, 5, (uint64_t)tss, sizeof(struct tss_entry) - 1, 0x89, 0);
 
     // 3. Load GDT
-    gdtr.limit = sizeof(gdt) - 1;
-    gdtr.base  = (uint64_t)&gdt;
+    gdtr->limit = sizeof(gdts[0]) - 1;
+    gdtr->base  = (uint64_t)gdt;
     
-    load_gdt(&gdtr);
+    load_gdt(gdtr);
     load_tss(); // LTR instruction
 }
 
 // Helper to update the stack pointer used when an interrupt occurs
 void tss_set_stack(uint64_t stack_ptr) {
-    tss.rsp0 = stack_ptr;
+    tsss[cpu_id()].rsp0 = stack_ptr;
 }
\ No newline at end of file
@@ -15,11 +15,11 @@ load_gdt:
 
 .reload_cs:
     ; Reload data segments with Kernel Data (Offset 0x10)
+    ; Not FS/GS: a selector load zeroes their base, and GS base holds the
+    ; per-CPU block
     mov ax, 0x10
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
     mov ss, ax
     ret
 
@@ -1,5 +1,6 @@
 #include <idt.h>
 #include <util.h>
+#include <syscall.h>
 
 static struct idt_entry idt[IDT_ENTRIES];
 static struct idtr idtr;
@@ -35,6 +36,26 @@ static void pic_remap(void) {
     outb(0x21, a1);   outb(0xA1, a2);   // Restore masks
 }
 
+// Let one legacy IRQ line through the PIC
+void pic_unmask(uint8_t irq) {
+    uint16_t port = irq < 8 ? 0x21 : 0xA1;
+    outb(port, inb(port) & ~(1 << (irq % 8)));
+
+    // lines on the slave need the cascade open on the master too
+    if (irq >= 8) outb(0x21, inb(0x21) & ~(1 << 2));
+}
+
+// Mask every line, once the IOAPIC takes over
+void pic_disable(void) {
+    outb(0xA1, 0xFF);
+    outb(0x21, 0xFF);
+}
+
+void pic_eoi(uint8_t irq) {
+    if (irq >= 8) outb(0xA0, 0x20); // Slave
+    outb(0x20, 0x20);               // Master
+}
+
 void idt_init(void) {
     pic_remap();
 
@@ -43,10 +64,17 @@ void idt_init(void) {
     for (int i = 0; i < IDT_ENTRIES; i++) {
         idt_set_gate(i, isr_stub_table[i], 0x8E);
     }
+    // 0xEE = Present | Ring3 | Interrupt Gate, so user mode may int to it
+    idt_set_gate(SYSCALL_VECTOR, isr_stub_table[SYSCALL_VECTOR], 0xEE);
 
     idtr.base = (uint64_t)&idt;
     idtr.limit = sizeof(idt) - 1;
 
-    __asm__ volatile ("lidt %0" : : "m"(idtr));
+    idt_init_cpu();
     __asm__ volatile ("sti"); // Re-enable interrupts
+}
+
+// The table is shared, every CPU just loads it
+void idt_init_cpu(void) {
+    __asm__ volatile ("lidt %0" : : "m"(idtr));
 }
\ No newline at end of file
@@ -1,32 +1,123 @@
 #include <idt.h>
 #include <util.h> // debug_print
+#include <vmspace.h>
+#include <fpu.h>
+#include <serial.h>
+#include <apic.h>
+#include <cpu.h>
+#include <work.h>
+#include <sched.h>
+#include <syscall.h>
+
+// Handler and its context share a slot, four slots to a cache line
+struct irq_slot {
+    irq_handler_t handler;
+    void *ctx;
+};
+
+static struct irq_slot irq_table[IDT_ENTRIES] __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// Per-CPU so a busy line doesn't bounce a shared counter between CPUs
+static uint64_t irq_counts[MAX_CPUS][IDT_ENTRIES] __attribute__((aligned(CACHE_LINE_SIZE)));
+
+bool irq_register(uint8_t vector, irq_handler_t handler, void *ctx) {
+    if (vector < IRQ_VECTOR_BASE || handler == NULL) return false;
+    if (__atomic_load_n(&irq_table[vector].handler, __ATOMIC_RELAXED) != NULL) return false;
+
+    // ctx has to be in place before the dispatcher can see the handler
+    irq_table[vector].ctx = ctx;
+    __atomic_store_n(&irq_table[vector].handler, handler, __ATOMIC_RELEASE);
+    return true;
+}
+
+void irq_unregister(uint8_t vector) {
+    if (vector < IRQ_VECTOR_BASE) return;
+    __atomic_store_n(&irq_table[vector].handler, NULL, __ATOMIC_RELEASE);
+}
+
+uint64_t irq_count(uint8_t vector) {
+    uint64_t total = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        total += __atomic_load_n(&irq_counts[cpu][vector], __ATOMIC_RELAXED);
+    }
+    return total;
+}
 
 // This is called from Assembly
 void exception_handler(struct interrupt_frame *frame) {
     // 1. CPU Exceptions (0-31)
+    if (frame->int_no == 7) {
+        // Device Not Available: lazy FPU switch
+        if (fpu_handle_nm()) {
+            return;
+        }
+        debug_print("FPU used outside kernel_fpu_begin/end\n");
+    }
+
+    if (frame->int_no == 14) {
+        // Page Fault: demand paging gets the first look
+        uint64_t cr2;
+        __asm__ volatile ("mov %%cr2, %0" : "=r"(cr2));
+
+        if (vmspace_handle_fault(cr2, frame->err_code)) {
+            return;
+        }
+
+        debug_print("PAGE FAULT at ");
+        debug_print_hex(cr2);
+        debug_print(" rip ");
+        debug_print_hex(frame->rip);
+        debug_print(" err ");
+        debug_print_hex(frame->err_code);
+        debug_print("\n");
+    }
+
     if (frame->int_no < 32) {
+        // interrupts may never come back, don't leave the log in the ring
+        serial_sync();
         debug_print("CPU EXCEPTION! Halting.\n");
         // Print CR2 if page fault, dump regs, etc.
         hcf(); 
     }
 
-    // 2. Hardware Interrupts (32+)
-    if (frame->int_no >= 32) {
-        int irq = frame->int_no - 32;
+    // 2. System calls the slow way, same ABI as SYSCALL
+    if (frame->int_no == SYSCALL_VECTOR) {
+        uint64_t args[SYSCALL_ARGS] = { frame->rdi, frame->rsi, frame->rdx,
+                                        frame->r10, frame->r8, frame->r9 };
+        frame->rax = syscall_do(frame->rax, args);
 
-        if (irq == 0) {
-            // Timer Tick - Call Scheduler!
-            // schedule();
-        }
-        else if (irq == 1) {
-            // Keyboard - In Microkernel, we DO NOT read the scancode here.
-            // We verify the interrupt happened, send an IPC message to Driver(PID 4),
-            // and unblock it.
-            // msg_send(DRIVER_KEYBOARD, MSG_IRQ, 1);
-        }
+        // IPC returns its message here
+        frame->rsi = args[1];
+        frame->rdx = args[2];
+        frame->r10 = args[3];
+        frame->r8 = args[4];
+        frame->r9 = args[5];
+        sched_preempt();
+        return;
+    }
+
+    // 3. Hardware Interrupts (32+)
+    uint8_t vector = frame->int_no;
+    irq_counts[cpu_id()][vector]++;
+
+    // Spurious: the local APIC wants no EOI for it
+    if (vector == APIC_SPURIOUS_VECTOR) {
+        return;
+    }
+
+    // In a microkernel most of these just wake a driver through IPC
+    irq_handler_t handler = __atomic_load_n(&irq_table[vector].handler, __ATOMIC_ACQUIRE);
+    if (handler != NULL) {
+        handler(frame, irq_table[vector].ctx);
+    }
+
+    // Acknowledge the local APIC (or the PIC without one)
+    irq_eoi(vector);
 
-        // Acknowledge PIC (EOI)
-        if (irq >= 8) outb(0xA0, 0x20); // Slave
-        outb(0x20, 0x20);               // Master
+    // Bottom halves, unless we interrupted code that had interrupts off,
+    // then a thread switch if the tick or a wakeup asked for one
+    if (frame->rflags & (1 << 9)) { // IF
+        work_run();
+        sched_preempt();
     }
 }
\ No newline at end of file
@@ -0,0 +1,395 @@
+#include <ipc.h>
+#include <sched.h>
+#include <slab.h>
+#include <vmspace.h>
+#include <vmm.h>
+#include <pmm.h>
+#include <vmalloc.h>
+#include <syscall.h>
+#include <util.h>
+
+extern uint64_t hhdm_offset;
+
+//
+// L4-style fast path: a call to a waiting receiver and the reply back to a
+// waiting caller both switch to the other thread directly, donating the
+// rest of the time slice. The run queues only see a thread when nobody is
+// waiting for it on the other side.
+//
+
+struct endpoint *endpoint_create(void){
+    struct endpoint *ep = kmalloc(sizeof(struct endpoint));
+    if(!ep) return NULL;
+
+    memset(ep, 0, sizeof(struct endpoint));
+    ep->lock = (spinlock_t)SPINLOCK_INIT;
+    return ep;
+}
+
+void endpoint_destroy(struct endpoint *ep){
+    if(ep->senders || ep->receivers){
+        debug_print("Endpoint destroyed with threads waiting\n");
+        hcf();
+    }
+    kfree(ep);
+}
+
+// ep->lock held
+static void wait_push(struct thread **head, struct thread **tail, struct thread *t){
+    t->ipc_next = NULL;
+    if(*tail) (*tail)->ipc_next = t;
+    else *head = t;
+    *tail = t;
+}
+
+static struct thread *wait_pop(struct thread **head, struct thread **tail){
+    struct thread *t = *head;
+    if(t){
+        *head = t->ipc_next;
+        if(*head == NULL) *tail = NULL;
+        t->ipc_next = NULL;
+    }
+    return t;
+}
+
+// Copy msg into to's buffer, moving or sharing the pages it grants. Both
+// threads are held in place: to is blocked, from is blocked or running this.
+static void deliver(struct thread *from, struct thread *to, const struct ipc_msg *msg){
+    struct ipc_msg *dst = to->ipc_buf;
+    *dst = *msg;
+    if(!(msg->tag & IPC_TAG_GRANT)) return;
+
+    uint64_t pages = msg->words[1];
+    bool move = !(msg->tag & IPC_TAG_SHARE);
+    if(from->space && to->space && pages <= to->ipc_window_pages &&
+       vmspace_grant(from->space, msg->words[0], to->space, to->ipc_window, pages, move)){
+        dst->words[0] = to->ipc_window;
+    } else {
+        dst->tag = (dst->tag & ~IPC_TAG_GRANT) | IPC_TAG_GRANT_FAILED;
+    }
+}
+
+void ipc_set_window(uint64_t addr, uint64_t pages){
+    struct thread *self = thread_current();
+    self->ipc_window = addr;
+    self->ipc_window_pages = pages;
+}
+
+int ipc_call(struct endpoint *ep, struct ipc_msg *msg){
+    struct thread *self = thread_current();
+    if(self->state == THREAD_IDLE) return IPC_EINVAL;
+
+    uint64_t flags = irq_save();
+    self->ipc_buf = msg;
+    // blocked before anyone can find us, whoever replies claims or wakes us
+    thread_set_blocked();
+
+    spin_lock(&ep->lock);
+    struct thread *receiver = wait_pop(&ep->receivers, &ep->receivers_tail);
+    if(receiver == NULL){
+        wait_push(&ep->senders, &ep->senders_tail, self);
+        spin_unlock(&ep->lock);
+        thread_block();
+    } else {
+        spin_unlock(&ep->lock);
+        deliver(self, receiver, msg);
+        receiver->ipc_caller = self;
+        sched_switch_to(receiver);
+    }
+
+    // the reply is in msg
+    irq_restore(flags);
+    return IPC_OK;
+}
+
+int ipc_reply_and_wait(struct endpoint *ep, struct ipc_msg *msg){
+    struct thread *self = thread_current();
+    if(self->state == THREAD_IDLE) return IPC_EINVAL;
+
+    uint64_t flags = irq_save();
+    struct thread *caller = self->ipc_caller;
+    self->ipc_caller = NULL;
+    if(caller) deliver(self, caller, msg);
+
+    self->ipc_buf = msg;
+    spin_lock(&ep->lock);
+    struct thread *sender = wait_pop(&ep->senders, &ep->senders_tail);
+    if(sender){
+        // the next call is already here, no need to block
+        spin_unlock(&ep->lock);
+        deliver(sender, self, sender->ipc_buf);
+        self->ipc_caller = sender;
+        if(caller) thread_wake(caller);
+        irq_restore(flags);
+        return IPC_OK;
+    }
+
+    thread_set_blocked();
+    wait_push(&ep->receivers, &ep->receivers_tail, self);
+    spin_unlock(&ep->lock);
+
+    if(caller) sched_switch_to(caller);
+    else thread_block();
+
+    // a sender filled msg and made itself our caller
+    irq_restore(flags);
+    return IPC_OK;
+}
+
+int ipc_reply(struct ipc_msg *msg){
+    struct thread *self = thread_current();
+    struct thread *caller = self->ipc_caller;
+    if(caller == NULL) return IPC_EINVAL;
+
+    self->ipc_caller = NULL;
+    deliver(self, caller, msg);
+    thread_wake(caller);
+    return IPC_OK;
+}
+
+int ipc_handle_install(struct thread *t, struct endpoint *ep){
+    for(int handle = 0; handle < IPC_HANDLES; handle++){
+        if(t->ipc_handles[handle] == NULL){
+            t->ipc_handles[handle] = ep;
+            return handle;
+        }
+    }
+    return -1;
+}
+
+// The message registers, rsi through r9, are a struct ipc_msg in place
+_Static_assert(sizeof(struct ipc_msg) == (SYSCALL_ARGS - 1) * sizeof(uint64_t),
+               "struct ipc_msg must be the message registers");
+
+static struct endpoint *handle_lookup(uint64_t handle){
+    if(handle >= IPC_HANDLES) return NULL;
+    return thread_current()->ipc_handles[handle];
+}
+
+uint64_t ipc_sys_call(uint64_t *args){
+    struct endpoint *ep = handle_lookup(args[0]);
+    if(!ep) return IPC_EHANDLE;
+    return ipc_call(ep, (struct ipc_msg*)&args[1]);
+}
+
+uint64_t ipc_sys_reply_wait(uint64_t *args){
+    struct endpoint *ep = handle_lookup(args[0]);
+    if(!ep) return IPC_EHANDLE;
+    return ipc_reply_and_wait(ep, (struct ipc_msg*)&args[1]);
+}
+
+static void echo(struct endpoint *ep){
+    struct ipc_msg msg = { 0 };
+
+    for(;;){
+        if(ipc_reply_and_wait(ep, &msg) != IPC_OK) break;
+        if(msg.tag == IPC_ECHO_STOP){
+            ipc_reply(&msg);
+            break;
+        }
+        msg.words[0]++;     // Some proof it went through us
+    }
+}
+
+void ipc_echo_thread(void *arg){
+    echo(arg);
+}
+
+// --- Ping-pong benchmark ---
+
+struct ipc_bench {
+    struct endpoint *ep;
+    uint64_t iterations;
+    uint64_t pages;         // Grant benchmark only
+    uint64_t cycles;
+    uint32_t errors;
+    uint32_t done;
+};
+
+static void ipc_bench_server(void *arg){
+    struct ipc_bench *bench = arg;
+    echo(bench->ep);
+    __atomic_fetch_add(&bench->done, 1, __ATOMIC_RELEASE);
+}
+
+static void ipc_bench_client(void *arg){
+    struct ipc_bench *bench = arg;
+    struct ipc_msg msg = { .tag = IPC_ECHO_PING };
+
+    // the first call may find the server not waiting yet
+    ipc_call(bench->ep, &msg);
+
+    uint64_t start = rdtsc();
+    for(uint64_t i = 0; i < bench->iterations; i++){
+        msg.tag = IPC_ECHO_PING;
+        msg.words[0] = i;
+        ipc_call(bench->ep, &msg);
+        if(msg.words[0] != i + 1) bench->errors++;
+    }
+    bench->cycles = rdtsc() - start;
+
+    msg.tag = IPC_ECHO_STOP;
+    ipc_call(bench->ep, &msg);
+    __atomic_fetch_add(&bench->done, 1, __ATOMIC_RELEASE);
+}
+
+void ipc_bench(uint64_t iterations){
+    if(iterations == 0) return;
+
+    struct ipc_bench bench = { .ep = endpoint_create(), .iterations = iterations };
+    if(!bench.ep){
+        debug_print("ipc_bench: out of memory\n");
+        return;
+    }
+
+    struct thread *server = thread_create("ipc_server", ipc_bench_server, &bench, 0);
+    struct thread *client = thread_create("ipc_client", ipc_bench_client, &bench, 0);
+    if(!server || !client){
+        debug_print("ipc_bench: no threads\n");
+        thread_destroy(server);
+        thread_destroy(client);
+        endpoint_destroy(bench.ep);
+        return;
+    }
+    thread_wake(server);
+    thread_wake(client);
+
+    while(__atomic_load_n(&bench.done, __ATOMIC_ACQUIRE) != 2){
+        yield();
+    }
+    endpoint_destroy(bench.ep);
+
+    debug_print("IPC round trip: ");
+    debug_print_dec(bench.cycles / iterations);
+    debug_print(" cycles");
+    if(bench.errors){
+        debug_print(", ");
+        debug_print_dec(bench.errors);
+        debug_print(" corrupted");
+    }
+    debug_print("\n");
+}
+
+// --- Grant benchmark: a buffer moved to the server and back ---
+
+#define GRANT_BENCH_BUF    0x10000000ULL    // The client's, in its own space
+#define GRANT_BENCH_WINDOW 0x20000000ULL    // The server's
+
+static void grant_bench_server(void *arg){
+    struct ipc_bench *bench = arg;
+    struct ipc_msg msg = { 0 };
+    ipc_set_window(GRANT_BENCH_WINDOW, bench->pages);
+
+    for(;;){
+        if(ipc_reply_and_wait(bench->ep, &msg) != IPC_OK) break;
+        if(IPC_TAG_LABEL(msg.tag) == IPC_ECHO_STOP){
+            ipc_reply(&msg);
+            break;
+        }
+        if(!(msg.tag & IPC_TAG_GRANT)){
+            bench->errors++;
+            msg.tag = IPC_ECHO_PING;
+            continue;
+        }
+
+        // touch it to show it's ours now, then send it back
+        volatile uint64_t *data = (uint64_t*)msg.words[0];
+        data[0]++;
+        msg.tag = IPC_ECHO_PING | IPC_TAG_GRANT;
+    }
+    __atomic_fetch_add(&bench->done, 1, __ATOMIC_RELEASE);
+}
+
+static void grant_bench_client(void *arg){
+    struct ipc_bench *bench = arg;
+    struct ipc_msg msg;
+    volatile uint64_t *data = (uint64_t*)GRANT_BENCH_BUF;
+    ipc_set_window(GRANT_BENCH_BUF, bench->pages);
+
+    uint64_t start = rdtsc();
+    for(uint64_t i = 0; i < bench->iterations; i++){
+        msg.tag = IPC_ECHO_PING | IPC_TAG_GRANT;
+        msg.words[0] = GRANT_BENCH_BUF;
+        msg.words[1] = bench->pages;
+        ipc_call(bench->ep, &msg);
+        if(!(msg.tag & IPC_TAG_GRANT) || data[0] != i + 1) bench->errors++;
+    }
+    bench->cycles = rdtsc() - start;
+
+    msg.tag = IPC_ECHO_STOP;
+    ipc_call(bench->ep, &msg);
+    __atomic_fetch_add(&bench->done, 1, __ATOMIC_RELEASE);
+}
+
+void ipc_grant_bench(uint64_t pages, uint64_t iterations){
+    if(pages == 0 || iterations == 0) return;
+
+    // the threads own their spaces and free them, with the pages, on exit
+    struct ipc_bench bench = { .ep = endpoint_create(), .iterations = iterations, .pages = pages };
+    struct vm_space *client_space = vmspace_create();
+    struct vm_space *server_space = vmspace_create();
+    struct thread *server = NULL, *client = NULL;
+    if(!bench.ep || !client_space || !server_space) goto oom;
+
+    for(uint64_t i = 0; i < pages; i++){
+        void *frame = pmm_alloc_zeroed_page();
+        if(!frame) goto oom;
+        vmm_map_page(client_space->pml4, GRANT_BENCH_BUF + i * PAGE_SIZE, (uint64_t)frame,
+                     PTE_PRESENT | PTE_RW | PTE_USER | PTE_NX);
+    }
+
+    server = thread_create("grant_server", grant_bench_server, &bench, 0);
+    client = thread_create("grant_client", grant_bench_client, &bench, 0);
+    if(!server || !client) goto oom;
+
+    server->space = server_space;
+    client->space = client_space;
+    thread_wake(server);
+    thread_wake(client);
+
+    while(__atomic_load_n(&bench.done, __ATOMIC_ACQUIRE) != 2){
+        yield();
+    }
+    endpoint_destroy(bench.ep);
+
+    // what moving the pages saves: copying them there and back
+    uint64_t bytes = pages * PAGE_SIZE;
+    void *a = vmalloc(bytes);
+    void *b = vmalloc(bytes);
+    uint64_t copy_cycles = 0;
+    if(a && b){
+        memset(a, 0, bytes);
+        memset(b, 0, bytes);
+        uint64_t start = rdtsc();
+        for(uint64_t i = 0; i < iterations; i++){
+            memcpy(b, a, bytes);
+            memcpy(a, b, bytes);
+        }
+        copy_cycles = (rdtsc() - start) / iterations;
+    }
+    vfree(a);
+    vfree(b);
+
+    debug_print("IPC grant of ");
+    debug_print_dec(pages);
+    debug_print(" pages round trip: ");
+    debug_print_dec(bench.cycles / iterations);
+    debug_print(" cycles, copying ");
+    debug_print_dec(copy_cycles);
+    if(bench.errors){
+        debug_print(", ");
+        debug_print_dec(bench.errors);
+        debug_print(" failed");
+    }
+    debug_print("\n");
+    return;
+
+oom:
+    // the spaces (and the pages mapped so far) aren't the threads' yet
+    debug_print("ipc_grant_bench: out of memory\n");
+    thread_destroy(server);
+    thread_destroy(client);
+    if(client_space) vmspace_destroy(client_space);
+    if(server_space) vmspace_destroy(server_space);
+    if(bench.ep) endpoint_destroy(bench.ep);
+}
\ No newline at end of file
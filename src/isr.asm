@@ -20,6 +20,13 @@ isr_stub_%+%1:
 
 ; --- COMMON HANDLER (Saves Context) ---
 isr_common:
+    ; 0. Coming from user mode, swap in the kernel's GS base (per-CPU block).
+    ;    CS sits above int_no, err_code and RIP.
+    test qword [rsp + 24], 3
+    jz .kernel_entry
+    swapgs
+.kernel_entry:
+
     ; 1. Save all registers
     push r15
     push r14
@@ -62,6 +69,12 @@ isr_common:
 
     ; 4. Cleanup error code and interrupt number (16 bytes)
     add rsp, 16
+
+    ; 5. Going back to user mode, give it its GS base back
+    test qword [rsp + 8], 3
+    jz .kernel_exit
+    swapgs
+.kernel_exit:
     iretq
 
 ; --- EXCEPTION STUBS (0-31) ---
@@ -98,18 +111,13 @@ isr_no_err_stub 29
 isr_err_stub    30
 isr_no_err_stub 31
 
-; --- DEFAULT HANDLER FOR UNUSED INTERRUPTS ---
-; This was the missing symbol causing your error
-isr_stub_default_handler:
-    push 0
-    push 255          ; Use 255 or similar to indicate "Unknown/Spurious"
-    jmp isr_common
-
-; --- IRQ STUBS (32+) ---
-; Ideally you should define these individually like above (32-47)
-; But for now, we will map them to the default or you can add:
-; isr_no_err_stub 32
-; isr_no_err_stub 33 ... etc
+; --- IRQ STUBS (32-255) ---
+; Every external vector gets its own stub so the C side knows which one fired
+%assign i 32
+%rep    224
+isr_no_err_stub i
+%assign i i+1
+%endrep
 
 
 ; --- IDT POINTER TABLE ---
@@ -117,13 +125,8 @@ section .data
 global isr_stub_table
 
 isr_stub_table:
-; Generate pointers for 0-31
 %assign i 0 
-%rep    32 
+%rep    256 
     dq isr_stub_%+i
 %assign i i+1 
-%endrep
-
-; Fill the remaining entries (32 to 255) with the default handler
-; FIX: Use (256 - 32) so the table is exactly 256 entries long.
-times (256 - 32) dq isr_stub_default_handler
\ No newline at end of file
+%endrep
\ No newline at end of file
@@ -7,6 +7,18 @@
 #include <vmm.h>
 #include <gdt.h>
 #include <idt.h>
+#include <slab.h>
+#include <vmspace.h>
+#include <vmalloc.h>
+#include <fpu.h>
+#include <simd.h>
+#include <serial.h>
+#include <apic.h>
+#include <work.h>
+#include <smp.h>
+#include <sched.h>
+#include <syscall.h>
+#include <ipc.h>
 
 
 
@@ -52,31 +64,100 @@ static volatile struct limine_hhdm_request hhdm_request = {
     .revision = 0
 };
 
+// Our own copy of the framebuffer description. The Limine response lives in
+// bootloader reclaimable memory, which goes back to the PMM after boot.
+static struct limine_framebuffer fb_info;
+static bool fb_present = false;
+static uint64_t fb_boot_cycles = 0;    // Fill through the bootloader's mapping
+
+// Kernel stack for the BSP once we leave the bootloader's one (16 KiB)
+#define KERNEL_STACK_ORDER 2
+
+// --- Helper: Fill the whole screen, returns the cycles it took ---
+static uint64_t fb_fill(volatile uint32_t *fb_ptr, uint32_t color) {
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < fb_info.width * fb_info.height; i++) {
+        fb_ptr[i] = color;
+    }
+    return rdtsc() - start;
+}
 
 // --- Helper: Panic (Red Screen of Death) ---
 void panic(void) {
-    if (framebuffer_request.response != NULL && framebuffer_request.response->framebuffer_count > 0) {
-        struct limine_framebuffer *fb = framebuffer_request.response->framebuffers[0];
-        volatile uint32_t *fb_ptr = fb->address;
+    serial_sync(); // Get the log out while we still can
+    if (fb_present) {
         // Fill screen with RED
-        for (size_t i = 0; i < fb->width * fb->height; i++) {
-            fb_ptr[i] = 0xFF0000; 
-        }
+        fb_fill(fb_info.address, 0xFF0000);
     }
     hcf(); // Halt
 }
 
+// Free vector for the dispatch test, fired with a software int
+#define TEST_IRQ_VECTOR 0x40
+
+static void count_irq(struct interrupt_frame *frame, void *ctx) {
+    (void)frame;
+    (*(uint64_t*)ctx)++;
+}
+
+static void count_work(void *ctx) {
+    (*(uint64_t*)ctx)++;
+}
+
+static uint64_t test_work_runs = 0;
+static struct work test_work = WORK_INIT(count_work, &test_work_runs);
+
+// Hard half of the work test: queue twice, the item may still only run once
+static void queue_irq(struct interrupt_frame *frame, void *ctx) {
+    (void)frame;
+    (void)ctx;
+    if (!work_queue(&test_work)) panic();
+    if (work_queue(&test_work)) panic(); // FAIL: Queued while pending
+}
+
+#define SCHED_TEST_THREADS 3
+#define SCHED_TEST_YIELDS 100
+
+static uint64_t sched_test_done = 0;
+
+static void sched_test_thread(void *arg) {
+    uint64_t *runs = arg;
+    for (int i = 0; i < SCHED_TEST_YIELDS; i++) {
+        (*runs)++;
+        yield();
+    }
+    __atomic_fetch_add(&sched_test_done, 1, __ATOMIC_RELEASE);
+}
+
+// --- Idle loop: background work, then sleep until the next interrupt ---
+void idle_loop(void) {
+    for (;;) {
+        // threads first, ours or stolen from a busy CPU
+        yield();
+
+        // work an interrupt exit left over because its batch limit ran out
+        __asm__ volatile ("cli");
+        work_run();
+        __asm__ volatile ("sti");
+
+        // refill the pre-zeroed page pool while nothing else needs the CPU
+        while (!work_pending() && pmm_zero_idle()) { }
+
+        __asm__ volatile ("cli");
+        if (!work_pending()) {
+            __asm__ volatile ("sti; hlt");
+        }
+        __asm__ volatile ("sti");
+    }
+}
+
 // --- Helper: Success (Green Screen) ---
 void success(void) {
-    if (framebuffer_request.response != NULL && framebuffer_request.response->framebuffer_count > 0) {
-        struct limine_framebuffer *fb = framebuffer_request.response->framebuffers[0];
-        volatile uint32_t *fb_ptr = fb->address;
+    if (fb_present) {
         // Fill screen with GREEN
-        for (size_t i = 0; i < fb->width * fb->height; i++) {
-            fb_ptr[i] = 0x00FF00; 
-        }
+        fb_fill(fb_info.address, 0x00FF00);
     }
-    hcf();
+    idle_loop();
 }
 
 uint64_t get_framebuffer_phys_addr(struct limine_memmap_response *map) {
@@ -89,6 +170,8 @@ uint64_t get_framebuffer_phys_addr(struct limine_memmap_response *map) {
     return 0; // Not found
 }
 
+static void kmain_late(void);
+
 // --- MAIN KERNEL ENTRY ---
 void kmain(void) {
     // 1. Basic Revision Check
@@ -96,6 +179,9 @@ void kmain(void) {
         hcf();
     }
 
+    // per-CPU data through GS, cpu_id() is used from here on
+    smp_init_bsp();
+
     // 2. Initialize the PMM
     // We must pass the responses from main.c to the PMM
     if (memmap_request.response == NULL || hhdm_request.response == NULL) {
@@ -104,20 +190,51 @@ void kmain(void) {
 
     hhdm_offset = hhdm_request.response->offset;
 
+    mem_init();
     serial_init();
     
     // Call your init function
     debug_print("---START DEBUG---\n");
     pmm_init(memmap_request.response, hhdm_offset);
-    debug_print("PMM Initialized\n Initializing VMM...");
+    debug_print("PMM Initialized\n");
+
+    const struct pmm_init_stats *pmm_stats = pmm_get_init_stats();
+    debug_print(" pages free: ");
+    debug_print_dec(pmm_stats->pages_free);
+    debug_print(" / tracked: ");
+    debug_print_dec(pmm_stats->pages_tracked);
+    debug_print(" in ");
+    debug_print_dec(pmm_stats->blocks);
+    debug_print(" blocks, ");
+    debug_print_dec(pmm_stats->tsc_cycles);
+    debug_print(" cycles\n");
+
+    // Time a fill while the bootloader's mapping is the only one of the
+    // frames; vmm_init remaps them write-combining, and mapping them with
+    // two memory types at once isn't allowed
+    if (framebuffer_request.response != NULL && framebuffer_request.response->framebuffer_count > 0) {
+        fb_info = *framebuffer_request.response->framebuffers[0];
+        fb_boot_cycles = fb_fill(fb_info.address, 0);
+    }
+
+    debug_print(" Initializing VMM...");
     vmm_init(memmap_request.response);
     debug_print("VMM Initialized\n");
+    slab_init();
+    vmspace_init();
+    vmalloc_init();
+    fpu_init();
+    debug_print("Slab Initialized\n");
     debug_print("---END DEBUG---\n");
 
     gdt_init();
+    syscall_init_cpu();
     idt_init();
+    apic_init();        // MADT is in bootloader memory, before the reclaim
+    serial_enable_irq();
+    sched_init();
+    smp_init();         // APs start on bootloader stacks, before the reclaim
 
-    
 
     // 1. Get the Physical Address of the framebuffer
     uint64_t fb_phys = get_framebuffer_phys_addr(memmap_request.response);
@@ -126,9 +243,52 @@ void kmain(void) {
     uint64_t hhdm_offset = hhdm_request.response->offset;
     volatile uint32_t *new_fb_ptr = (uint32_t*)(fb_phys + hhdm_offset);
     
-    // 3. Update the global struct so panic() uses the new address
-    // (Ideally, don't hack the struct like this, but for now it works)
-    framebuffer_request.response->framebuffers[0]->address = (void*)new_fb_ptr;
+    // 3. Keep our own copy so panic() uses the new address and survives the reclaim
+    if (framebuffer_request.response != NULL && framebuffer_request.response->framebuffer_count > 0) {
+        fb_info = *framebuffer_request.response->framebuffers[0];
+        fb_info.address = (void*)new_fb_ptr;
+        fb_info.edid = NULL;   // These point into reclaimable memory
+        fb_info.modes = NULL;
+        fb_present = true;
+    }
+
+    // 4. Leave the bootloader stack, it is reclaimable memory as well
+    void *stack_phys = pmm_alloc_pages(KERNEL_STACK_ORDER);
+    if (stack_phys == NULL) panic();
+
+    uint64_t stack_top = (uint64_t)stack_phys + hhdm_offset + (PAGE_SIZE << KERNEL_STACK_ORDER);
+    this_cpu()->kernel_stack = stack_top;
+    tss_set_stack(stack_top);
+    switch_stack(stack_top, kmain_late);
+}
+
+// Everything after this point runs on a kernel-owned stack
+static void kmain_late(void) {
+    // Nothing references the Limine responses any more, hand their memory back
+    size_t reclaimed = pmm_reclaim_bootloader(memmap_request.response);
+    debug_print("Reclaimed ");
+    debug_print_dec(reclaimed);
+    debug_print(" bootloader pages\n");
+
+    // Full-screen fill through the bootloader's mapping (timed in kmain)
+    // vs the write-combining HHDM
+    if (fb_present) {
+        uint64_t wc_cycles = fb_fill(fb_info.address, 0);
+        debug_print("Framebuffer fill: ");
+        debug_print_dec(fb_boot_cycles);
+        debug_print(" cycles before vmm_init, ");
+        debug_print_dec(wc_cycles);
+        debug_print(" cycles WC\n");
+    }
+
+    // String function variants, 16 bytes up to 64 KiB
+    void *bench_dst = vmalloc(64 << 10);
+    void *bench_src = vmalloc(64 << 10);
+    if (bench_dst != NULL && bench_src != NULL) {
+        mem_bench(bench_dst, bench_src, 64 << 10);
+    }
+    vfree(bench_dst);
+    vfree(bench_src);
 
     // success();
 
@@ -174,12 +334,309 @@ void kmain(void) {
     // For now, just ensure we got a valid pointer back.
     if (phys_ptr_4 == NULL) panic();
 
+    // ============================================
+    // TEST 3b: Contiguous Allocation (Buddy)
+    // ============================================
+    // A 2 MiB block (order 9) must come back naturally aligned.
+    void *huge_ptr = pmm_alloc_pages(9);
+    if (huge_ptr == NULL) panic();
+    if (((uint64_t)huge_ptr % (PAGE_SIZE << 9)) != 0) panic();
+
+    // Freeing it must coalesce, so the same block is available again.
+    size_t free_before = pmm_get_free_page_count();
+    pmm_free_pages(huge_ptr, 9);
+    if (pmm_get_free_page_count() != free_before + 512) panic();
+
+    void *huge_ptr_2 = pmm_alloc_pages(9);
+    if (huge_ptr_2 == NULL) panic();
+    pmm_free_pages(huge_ptr_2, 9);
+
+    // ============================================
+    // TEST 3c: Zeroed Allocation
+    // ============================================
+    void *zeroed_phys = pmm_alloc_zeroed_page();
+    if (zeroed_phys == NULL) panic();
+
+    uint64_t *zeroed_virt = (uint64_t*)((uint64_t)zeroed_phys + hhdm_offset);
+    for (size_t i = 0; i < PAGE_SIZE / 8; i++) {
+        if (zeroed_virt[i] != 0) panic(); // FAIL: page came back dirty
+    }
+    pmm_free_page(zeroed_phys);
+
+    // ============================================
+    // TEST 3d: Kernel Heap (Slab + Large kmalloc)
+    // ============================================
+    uint64_t *small_obj = kmalloc(24);      // kmalloc-32
+    uint64_t *line_obj = kmalloc(100);      // kmalloc-128
+    uint8_t *large_obj = kmalloc(3 * PAGE_SIZE);
+    if (small_obj == NULL || line_obj == NULL || large_obj == NULL) panic();
+    if (((uint64_t)line_obj % 64) != 0) panic(); // FAIL: not cache-line aligned
+
+    small_obj[2] = 0x1234;
+    large_obj[3 * PAGE_SIZE - 1] = 0xAB;
+    kfree(small_obj);
+    kfree(line_obj);
+    kfree(large_obj);
+
+    // A freed object comes straight back from the per-CPU list
+    if (kmalloc(24) != small_obj) panic();
+    kfree(small_obj);
+
+    // ============================================
+    // TEST 3e: Demand Paging
+    // ============================================
+    // Reserving 64 MiB costs nothing; touching one page faults in one frame.
+    uint64_t lazy_base = 0x0000100000000000;
+    if (!vm_region_add(&kernel_space, lazy_base, 64 << 20, PTE_RW | PTE_NX)) panic();
+
+    size_t free_lazy = pmm_get_free_page_count();
+    volatile uint64_t *lazy = (volatile uint64_t*)(lazy_base + (32 << 20));
+    if (*lazy != 0) panic();            // FAIL: demand-zero page isn't zero
+    *lazy = 0xC0FFEE;
+    if (*lazy != 0xC0FFEE) panic();
+    if (free_lazy - pmm_get_free_page_count() > 8) panic(); // one frame + tables
+
+    vm_region_remove(&kernel_space, lazy_base);
+
+    // ============================================
+    // TEST 3f: Copy-on-Write Clone
+    // ============================================
+    struct vm_space *parent = vmspace_create();
+    if (parent == NULL) panic();
+    if (!vm_region_add(parent, lazy_base, 4 * PAGE_SIZE, PTE_RW | PTE_NX)) panic();
+
+    vmspace_switch(parent);
+    volatile uint64_t *cow = (volatile uint64_t*)lazy_base;
+    *cow = 0x1111;
+
+    struct vm_space *child = vmspace_clone(parent);
+    if (child == NULL) panic();
+
+    uint64_t shared = *vmm_get_pte(parent->pml4, lazy_base) & PHYS_ADDR_MASK;
+    if (pmm_page_refcount((void*)shared) != 2) panic(); // FAIL: frame not shared
+
+    // The child sees the parent's data, and its first write gets a private copy
+    vmspace_switch(child);
+    if (*cow != 0x1111) panic();
+    *cow = 0x2222;
+    if ((*vmm_get_pte(child->pml4, lazy_base) & PHYS_ADDR_MASK) == shared) panic();
+
+    // The parent is the last owner now, writing just takes the frame back
+    vmspace_switch(parent);
+    if (*cow != 0x1111) panic(); // FAIL: child's write leaked into the parent
+    *cow = 0x3333;
+    if ((*vmm_get_pte(parent->pml4, lazy_base) & PHYS_ADDR_MASK) != shared) panic();
+
+    vmspace_switch(&kernel_space);
+    vmspace_destroy(child);
+    vmspace_destroy(parent);
+
+    // ============================================
+    // TEST 3g: vmalloc and Kernel Stacks
+    // ============================================
+    struct vmalloc_stats va_before, va_after;
+    vmalloc_get_stats(&va_before);
+
+    // 1 MiB that needs no contiguous frames
+    uint8_t *vbuf = vmalloc(1 << 20);
+    void *kstack = kstack_alloc();
+    if (vbuf == NULL || kstack == NULL) panic();
+    vbuf[0] = 1;
+    vbuf[(1 << 20) - 1] = 2;
+    ((volatile uint64_t*)kstack)[-1] = 0x5AC4;
+
+    // The guard page right behind the buffer must stay unmapped
+    uint64_t *guard = vmm_get_pte(kernel_space.pml4, (uint64_t)vbuf + (1 << 20));
+    if (guard != NULL && (*guard & PTE_PRESENT)) panic();
+
+    vfree(vbuf);
+    kstack_free(kstack);
+
+    // Everything coalesces back into the ranges we started with
+    vmalloc_get_stats(&va_after);
+    if (va_after.areas != va_before.areas || va_after.free_ranges != va_before.free_ranges) panic();
+
+    // ============================================
+    // TEST 3h: String Functions
+    // ============================================
+    // Odd lengths and offsets go through the heads and tails of the word loops
+    uint8_t str_buf[64];
+    for (size_t i = 0; i < sizeof(str_buf); i++) str_buf[i] = (uint8_t)i;
+
+    memmove(str_buf + 3, str_buf + 1, 37);     // overlapping, backwards
+    if (str_buf[3] != 1 || str_buf[39] != 37 || str_buf[40] != 40) panic();
+    memmove(str_buf + 1, str_buf + 3, 37);     // overlapping, forwards
+    if (str_buf[1] != 1 || str_buf[37] != 37) panic();
+
+    memset(str_buf + 5, 0xEE, 21);
+    if (str_buf[4] != 4 || str_buf[5] != 0xEE || str_buf[25] != 0xEE || str_buf[26] != 26) panic();
+    if (memcmp(str_buf, str_buf + 1, 20) == 0) panic();
+
+    // ============================================
+    // TEST 3i: Vector Code in a Kernel FPU Region
+    // ============================================
+    uint8_t *simd_page = vmalloc(PAGE_SIZE);
+    if (simd_page == NULL) panic();
+    memset(simd_page, 0xFF, PAGE_SIZE);
+
+    kernel_fpu_begin();
+    zero_page_sse2(simd_page);
+    kernel_fpu_end();
+
+    for (size_t i = 0; i < PAGE_SIZE; i++) {
+        if (simd_page[i] != 0) panic(); // FAIL: SSE stores didn't land
+    }
+    vfree(simd_page);
+
+    // ============================================
+    // TEST 3j: IRQ Dispatch Table
+    // ============================================
+    uint64_t test_irqs = 0;
+    if (!irq_register(TEST_IRQ_VECTOR, count_irq, &test_irqs)) panic();
+    if (irq_register(TEST_IRQ_VECTOR, count_irq, &test_irqs)) panic(); // FAIL: Vector taken twice
+    if (irq_register(14, count_irq, &test_irqs)) panic(); // FAIL: Exceptions aren't IRQs
+
+    __asm__ volatile ("int %0" : : "i"(TEST_IRQ_VECTOR) : "memory");
+    __asm__ volatile ("int %0" : : "i"(TEST_IRQ_VECTOR) : "memory");
+    if (test_irqs != 2) panic(); // FAIL: Handler missed its vector
+    if (irq_count(TEST_IRQ_VECTOR) != 2) panic();
+    irq_unregister(TEST_IRQ_VECTOR);
+
+    // ============================================
+    // TEST 3k: Deferred Work on Interrupt Exit
+    // ============================================
+    if (!irq_register(TEST_IRQ_VECTOR, queue_irq, NULL)) panic();
+    __asm__ volatile ("int %0" : : "i"(TEST_IRQ_VECTOR) : "memory");
+    if (test_work_runs != 1) panic(); // FAIL: Work didn't run on the way out
+    irq_unregister(TEST_IRQ_VECTOR);
+
+    // ============================================
+    // TEST 3l: Per-CPU Data
+    // ============================================
+    if (this_cpu() != smp_cpu(0) || cpu_id() != 0) panic(); // FAIL: GS isn't the BSP's block
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        if (smp_cpu(i)->self != smp_cpu(i)) panic(); // FAIL: CPU came up without its GS base
+    }
+
+    // ============================================
+    // TEST 3m: Kernel Threads and Yield
+    // ============================================
+    uint64_t sched_runs[SCHED_TEST_THREADS] = { 0 };
+    for (int i = 0; i < SCHED_TEST_THREADS; i++) {
+        struct thread *t = thread_create("sched_test", sched_test_thread, &sched_runs[i], 1);
+        if (t == NULL) panic();
+        if (!thread_wake(t)) panic(); // FAIL: New threads start blocked
+    }
+
+    // we are the idle thread, so this only comes back once nothing else can run here
+    while (__atomic_load_n(&sched_test_done, __ATOMIC_ACQUIRE) != SCHED_TEST_THREADS) {
+        yield();
+    }
+    for (int i = 0; i < SCHED_TEST_THREADS; i++) {
+        if (sched_runs[i] != SCHED_TEST_YIELDS) panic(); // FAIL: Thread lost its state
+    }
+
+    // ============================================
+    // TEST 3n: System Calls from Ring 3
+    // ============================================
+    uint64_t syscall_args[SYSCALL_ARGS] = { 0 };
+    if (syscall_do(SYS_NULL, syscall_args) != 0) panic();
+    if (syscall_do(SYS_COUNT, syscall_args) != SYSCALL_ENOSYS) panic(); // FAIL: Unknown number ran something
+    if (syscall_do(SYS_IPC_CALL, syscall_args) != IPC_EHANDLE) panic(); // FAIL: Called through a handle we don't have
+    syscall_bench(10000); // Only returns once the user thread made it through both paths
+
+    // ============================================
+    // TEST 3o: Synchronous IPC
+    // ============================================
+    struct ipc_msg idle_msg = { 0 };
+    struct endpoint *idle_ep = endpoint_create();
+    if (idle_ep == NULL) panic();
+    if (ipc_call(idle_ep, &idle_msg) != IPC_EINVAL) panic(); // FAIL: Idle thread went to sleep
+    endpoint_destroy(idle_ep);
+    ipc_bench(10000);
+    ipc_grant_bench(16, 1000);
+
+    // ============================================
+    // TEST 3p: Grants Between Address Spaces
+    // ============================================
+    struct vm_space *grant_from = vmspace_create();
+    struct vm_space *grant_to = vmspace_create();
+    if (grant_from == NULL || grant_to == NULL) panic();
+    void *grant_frame = pmm_alloc_zeroed_page();
+    if (grant_frame == NULL) panic();
+    vmm_map_page(grant_from->pml4, 0x10000000, (uint64_t)grant_frame, PTE_PRESENT | PTE_RW | PTE_USER);
+
+    if (!vmspace_grant(grant_from, 0x10000000, grant_to, 0x20000000, 1, false)) panic();
+    if (pmm_page_refcount(grant_frame) != 2) panic(); // FAIL: Share didn't take a reference
+    if (vmspace_grant(grant_from, 0x10000000, grant_to, 0x20000000, 1, true)) panic(); // FAIL: Overwrote a mapping
+    vmm_unmap_page(grant_to->pml4, 0x20000000);
+    pmm_page_put(grant_frame);
+
+    if (!vmspace_grant(grant_from, 0x10000000, grant_to, 0x20000000, 1, true)) panic();
+    uint64_t *grant_pte = vmm_get_pte(grant_from->pml4, 0x10000000);
+    if (grant_pte != NULL && (*grant_pte & PTE_PRESENT)) panic(); // FAIL: Move left the page behind
+    if ((*vmm_get_pte(grant_to->pml4, 0x20000000) & PHYS_ADDR_MASK) != (uint64_t)grant_frame) panic();
+    if (pmm_page_refcount(grant_frame) != 1) panic();
+    vmspace_destroy(grant_from);
+    vmspace_destroy(grant_to);
+
     // ============================================
     // TEST 4: Stats Check (Optional)
     // ============================================
     size_t free_mem = pmm_get_free_page_count();
     if (free_mem == 0) panic(); // FAIL: We definitely have more memory than that.
 
+    struct serial_stats log_stats;
+    serial_get_stats(&log_stats);
+    debug_print("serial: ");
+    debug_print_dec(log_stats.queued);
+    debug_print(" bytes queued, ");
+    debug_print_dec(log_stats.dropped);
+    debug_print(" dropped\n");
+
+    struct work_stats work_stats;
+    work_get_stats(&work_stats);
+    debug_print("work: ");
+    debug_print_dec(work_stats.ran);
+    debug_print(" of ");
+    debug_print_dec(work_stats.queued);
+    debug_print(" items run, ");
+    debug_print_dec(work_stats.deferred);
+    debug_print(" deferred to idle\n");
+
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        struct sched_stats sched_stats;
+        sched_get_stats(cpu, &sched_stats);
+        debug_print("cpu ");
+        debug_print_dec(cpu);
+        debug_print(": ");
+        debug_print_dec(sched_stats.switches);
+        debug_print(" switches, avg ");
+        debug_print_dec(sched_stats.switches ? sched_stats.switch_cycles / sched_stats.switches : 0);
+        debug_print(" max ");
+        debug_print_dec(sched_stats.switch_cycles_max);
+        debug_print(" cycles, ");
+        debug_print_dec(sched_stats.steals);
+        debug_print(" stolen, ");
+        debug_print_dec(sched_stats.handoffs);
+        debug_print(" handoffs, ");
+        debug_print_dec(sched_stats.runnable);
+        debug_print(" runnable\n");
+    }
+
+    debug_print("tlb: ");
+    debug_print_dec(tlb_shootdown_count());
+    debug_print(" shootdowns\n");
+
+    for (int v = IRQ_VECTOR_BASE; v < IDT_ENTRIES; v++) {
+        uint64_t fired = irq_count(v);
+        if (fired == 0 || v == TEST_IRQ_VECTOR) continue;
+        debug_print("vector ");
+        debug_print_dec(v);
+        debug_print(": ");
+        debug_print_dec(fired);
+        debug_print(" irqs\n");
+    }
 
     // If we made it here, everything works!
     success();
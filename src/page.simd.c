@@ -0,0 +1,32 @@
+#include <simd.h>
+
+typedef long long v2di __attribute__((vector_size(16)));
+typedef long long v4di __attribute__((vector_size(32)));
+
+void zero_page_sse2(void *page){
+    v2di *p = (v2di*)page;
+    v2di zero = { 0, 0 };
+
+    // a cache line per iteration, movntdq keeps the page out of the cache
+    for(size_t i = 0; i < 4096 / sizeof(v2di); i += 4){
+        __builtin_ia32_movntdq(&p[i + 0], zero);
+        __builtin_ia32_movntdq(&p[i + 1], zero);
+        __builtin_ia32_movntdq(&p[i + 2], zero);
+        __builtin_ia32_movntdq(&p[i + 3], zero);
+    }
+
+    __builtin_ia32_sfence();
+}
+
+__attribute__((target("avx")))
+void zero_page_avx(void *page){
+    v4di *p = (v4di*)page;
+    v4di zero = { 0, 0, 0, 0 };
+
+    for(size_t i = 0; i < 4096 / sizeof(v4di); i += 2){
+        __builtin_ia32_movntdq256(&p[i + 0], zero);
+        __builtin_ia32_movntdq256(&p[i + 1], zero);
+    }
+
+    __builtin_ia32_sfence();
+}
\ No newline at end of file
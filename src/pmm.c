@@ -1,16 +1,256 @@
 #include <pmm.h>
 #include <limine.h>
 #include <util.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <fpu.h>
+#include <simd.h>
 
-static uint8_t *bitmap = NULL;      // Virtual pointer to the bitmap
+extern uint64_t hhdm_offset;
+
+static uint64_t *bitmap = NULL;     // Virtual pointer to the bitmap
 static uint64_t highest_addr = 0;   // Highest physical page address
 static size_t free_memory = 0;      // Tracked for get_free_page_count()
 // static uint64_t hhdm_offset = 0;    // From Limine
 static uint64_t bitmap_size = 0;    // Size of bitmap table
-static uint64_t last_alloc_index = 0; // To optimize page lookup
+static uint64_t last_alloc_index = 0; // Top level summary word to start scanning from
+
+// Summary levels over the bitmap: a set bit means "there is a free bit below".
+// summary_l1 has one bit per bitmap word (64 pages), summary_l2 one bit per
+// summary_l1 word (4096 pages). Only summary_l2 is ever scanned linearly, and
+// that is 16 words for a terabyte of RAM; everything below is one tzcnt.
+static uint64_t *summary_l1 = NULL;
+static uint64_t *summary_l2 = NULL;
+static uint64_t summary_l1_size = 0;
+static uint64_t summary_l2_size = 0;
+
+//
+// Buddy allocator
+//
+// The buddy owns every free frame that is not sitting in the single page pool.
+// Free blocks are kept on per-order doubly linked lists; the list node lives
+// inside the free block itself (through the HHDM), so the lists cost nothing.
+// buddy_map[order] has one bit per naturally aligned block of that order and
+// is set while that block is on the free list, which makes the buddy check on
+// free O(1) without trusting the contents of the neighbouring memory.
+//
+// The bitmap above is the single page pool: a clear bit is a frame that
+// pmm_alloc_page() may hand out. Frames owned by the buddy (free or handed
+// out through pmm_alloc_pages) are set there, exactly like reserved memory.
+//
+
+struct free_block {
+    struct free_block *next;
+    struct free_block *prev;
+};
+
+static struct free_block *free_area[PMM_MAX_ORDER + 1];
+static size_t free_area_count[PMM_MAX_ORDER + 1];
+static uint64_t *buddy_map[PMM_MAX_ORDER + 1];
+
+static size_t pool_free = 0;        // Clear bits in bitmap (frames in the pool)
+
+static struct pmm_init_stats init_stats;
+
+// Everything above is global state and only touched with pmm_lock held
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+
+// Per-CPU magazine of free single pages in front of the pool. The owning CPU
+// pops and pushes with interrupts off and never takes pmm_lock unless the
+// magazine runs empty or full, and then moves PMM_PCP_BATCH pages at once.
+struct pmm_pcp {
+    uint32_t count;
+    uint64_t frames[PMM_PCP_SIZE];
+    struct pmm_pcp_stats stats;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct pmm_pcp pcp[MAX_CPUS];
+
+// Pool of frames that are already zero. Filled from the idle loop so page
+// tables and anonymous memory don't pay for the memset on the hot path.
+static spinlock_t zero_lock = SPINLOCK_INIT;
+static uint64_t zero_pool[PMM_ZERO_POOL_SIZE];
+static uint32_t zero_pool_count = 0;
+static struct pmm_zero_stats zero_stats;
+
+// Extra mappings of each frame beyond the first, for frames shared
+// copy-on-write. Zero for every frame with a single owner, so plain
+// alloc/free never touch it. Updated with atomics, not under pmm_lock.
+static uint16_t *page_refs = NULL;
+static uint64_t page_refs_size = 0;
+
+#define BUDDY_TEST(order, pfn) (buddy_map[order][((pfn) >> (order)) / 64] & (1ULL << (((pfn) >> (order)) % 64)))
+#define BUDDY_SET(order, pfn) (buddy_map[order][((pfn) >> (order)) / 64] |= (1ULL << (((pfn) >> (order)) % 64)))
+#define BUDDY_UNSET(order, pfn) (buddy_map[order][((pfn) >> (order)) / 64] &= ~(1ULL << (((pfn) >> (order)) % 64)))
+
+static inline struct free_block *pfn_to_block(uint64_t pfn){
+    return (struct free_block*)(pfn * PAGE_SIZE + hhdm_offset);
+}
+
+static inline uint64_t block_to_pfn(struct free_block *block){
+    return ((uint64_t)block - hhdm_offset) / PAGE_SIZE;
+}
+
+static void free_area_push(unsigned int order, uint64_t pfn){
+    struct free_block *block = pfn_to_block(pfn);
+
+    block->prev = NULL;
+    block->next = free_area[order];
+    if(block->next) block->next->prev = block;
+    free_area[order] = block;
+
+    free_area_count[order]++;
+    BUDDY_SET(order, pfn);
+}
+
+static void free_area_remove(unsigned int order, uint64_t pfn){
+    struct free_block *block = pfn_to_block(pfn);
+
+    if(block->prev) block->prev->next = block->next;
+    else free_area[order] = block->next;
+    if(block->next) block->next->prev = block->prev;
+
+    free_area_count[order]--;
+    BUDDY_UNSET(order, pfn);
+}
 
+// Set bits [start, end): masks for the partial edge words, memset for the rest
+static void bits_set_range(uint64_t *map, uint64_t start, uint64_t end){
+    if(start >= end) return;
+
+    uint64_t first = start / 64;
+    uint64_t last = (end - 1) / 64;
+    uint64_t head = ~0ULL << (start % 64);
+    uint64_t tail = ~0ULL >> (63 - (end - 1) % 64);
+
+    if(first == last){
+        map[first] |= head & tail;
+        return;
+    }
+
+    map[first] |= head;
+    memset(&map[first + 1], 0xFF, (last - first - 1) * 8);
+    map[last] |= tail;
+}
+
+// Clear bits [start, end), same shape as bits_set_range
+static void bits_clear_range(uint64_t *map, uint64_t start, uint64_t end){
+    if(start >= end) return;
+
+    uint64_t first = start / 64;
+    uint64_t last = (end - 1) / 64;
+    uint64_t head = ~0ULL << (start % 64);
+    uint64_t tail = ~0ULL >> (63 - (end - 1) % 64);
+
+    if(first == last){
+        map[first] &= ~(head & tail);
+        return;
+    }
+
+    map[first] &= ~head;
+    memset(&map[first + 1], 0, (last - first - 1) * 8);
+    map[last] &= ~tail;
+}
+
+// Put a frame into the pool and propagate "has free" up the summaries
+static inline void pool_mark_free(uint64_t pfn){
+    BITMAP_UNSET(pfn);
+    summary_l1[pfn / 4096] |= 1ULL << ((pfn / 64) % 64);
+    summary_l2[pfn / 262144] |= 1ULL << ((pfn / 4096) % 64);
+}
+
+// Range version of pool_mark_free: whole words and summary bits at once
+static void pool_mark_free_range(uint64_t start_pfn, uint64_t end_pfn){
+    bits_clear_range(bitmap, start_pfn, end_pfn);
+    bits_set_range(summary_l1, start_pfn / 64, DIV_ROUND_UP(end_pfn, 64));
+    bits_set_range(summary_l2, start_pfn / 4096, DIV_ROUND_UP(end_pfn, 4096));
+}
+
+// Bitmap word became full: clear its summary bit, and the one above if needed
+static inline void summary_word_full(uint64_t word){
+    summary_l1[word / 64] &= ~(1ULL << (word % 64));
+    if(summary_l1[word / 64] == 0){
+        summary_l2[word / 4096] &= ~(1ULL << ((word / 64) % 64));
+    }
+}
+
+// Take a block of exactly 2^order pages, splitting a larger one if needed
+static uint64_t buddy_take(unsigned int order){
+    unsigned int k = order;
+    while(k <= PMM_MAX_ORDER && free_area[k] == NULL){
+        k++;
+    }
+
+    if(k > PMM_MAX_ORDER){
+        return PMM_NO_PFN;
+    }
+
+    uint64_t pfn = block_to_pfn(free_area[k]);
+    free_area_remove(k, pfn);
+
+    // hand the upper halves back until the block is the requested size
+    while(k > order){
+        k--;
+        free_area_push(k, pfn + (1ULL << k));
+    }
+
+    return pfn;
+}
+
+// Return a block of 2^order pages, merging with its buddy as far as possible
+static void buddy_give(uint64_t pfn, unsigned int order){
+    while(order < PMM_MAX_ORDER){
+        uint64_t buddy = pfn ^ (1ULL << order);
+        if(!BUDDY_TEST(order, buddy)){
+            break;
+        }
+
+        free_area_remove(order, buddy);
+        pfn &= ~(1ULL << order);
+        order++;
+    }
+
+    free_area_push(order, pfn);
+}
+
+// Carve [start_pfn, end_pfn) into the largest naturally aligned blocks
+static void buddy_add_range(uint64_t start_pfn, uint64_t end_pfn){
+    while(start_pfn < end_pfn){
+        unsigned int order = PMM_MAX_ORDER;
+        while(order > 0 && ((start_pfn & ((1ULL << order) - 1)) || start_pfn + (1ULL << order) > end_pfn)){
+            order--;
+        }
+
+        buddy_give(start_pfn, order);
+        free_memory += PAGE_SIZE << order;
+        init_stats.blocks++;
+        start_pfn += 1ULL << order;
+    }
+}
+
+// Move a chunk from the buddy into the single page pool
+static int pool_refill(void){
+    unsigned int order = PMM_POOL_ORDER;
+    uint64_t pfn = buddy_take(order);
+
+    // no full chunk left, take whatever smaller block is still around
+    while(pfn == PMM_NO_PFN && order > 0){
+        order--;
+        pfn = buddy_take(order);
+    }
+
+    if(pfn == PMM_NO_PFN){
+        return 0;
+    }
+
+    pool_mark_free_range(pfn, pfn + (1ULL << order));
+    pool_free += 1ULL << order;
+
+    return 1;
+}
 
 void pmm_init(struct limine_memmap_response *map, uint64_t hhdm_offset){
+    uint64_t tsc_start = rdtsc();
 
     // find the highest memory address to determine bitmap size
     for(uint64_t i=0; i<map->entry_count; i++){
@@ -18,16 +258,34 @@ void pmm_init(struct limine_memmap_response *map, uint64_t hhdm_offset){
         if(cur_pg.base + cur_pg.length > highest_addr){
             highest_addr = cur_pg.base + cur_pg.length;
             uint64_t highest_pfn = (highest_addr + PAGE_SIZE - 1) / PAGE_SIZE;
-            bitmap_size = (highest_pfn + 7) / 8;
+            // whole 64-bit words, the pool hands chunks back a word at a time
+            bitmap_size = DIV_ROUND_UP(highest_pfn, 64) * 8;
         }
     }
 
+    // the buddy maps sit right behind the bitmap, one bit per block of each order
+    uint64_t highest_pfn = (highest_addr + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t buddy_map_size[PMM_MAX_ORDER + 1];
+    uint64_t meta_size = bitmap_size;
+    for(unsigned int order = 0; order <= PMM_MAX_ORDER; order++){
+        // +2 so the buddy of the last block still has a (always clear) bit
+        buddy_map_size[order] = DIV_ROUND_UP((highest_pfn >> order) + 2, 64) * 8;
+        meta_size += buddy_map_size[order];
+    }
+
+    summary_l1_size = DIV_ROUND_UP(bitmap_size / 8, 64) * 8;
+    summary_l2_size = DIV_ROUND_UP(summary_l1_size / 8, 64) * 8;
+    meta_size += summary_l1_size + summary_l2_size;
+
+    page_refs_size = DIV_ROUND_UP(highest_pfn * sizeof(uint16_t), 8) * 8;
+    meta_size += page_refs_size;
+
     // find a usable memory region large enough to hold the bitmap
     for(uint64_t i=0; i<map->entry_count; i++){
         struct limine_memmap_entry cur_pg = *(map->entries[i]);
-        if(cur_pg.length >= bitmap_size && cur_pg.type == LIMINE_MEMMAP_USABLE){
+        if(cur_pg.length >= meta_size && cur_pg.type == LIMINE_MEMMAP_USABLE){
             uint64_t bitmap_phys = cur_pg.base;
-            bitmap = (uint8_t*)(bitmap_phys + hhdm_offset);
+            bitmap = (uint64_t*)(bitmap_phys + hhdm_offset);
             break;
         }
     }
@@ -36,90 +294,398 @@ void pmm_init(struct limine_memmap_response *map, uint64_t hhdm_offset){
         hcf();
     }
 
-    // initialize all pages as used/reserved
-    memset(bitmap, 0xFF, bitmap_size);
-    
+    // initialize all pages as used/reserved (nothing is in the pool yet)
+    bits_set_range(bitmap, 0, bitmap_size * 8);
+
+    uint8_t *next_map = (uint8_t*)bitmap + bitmap_size;
+    summary_l1 = (uint64_t*)next_map;
+    memset(summary_l1, 0, summary_l1_size);
+    next_map += summary_l1_size;
+    summary_l2 = (uint64_t*)next_map;
+    memset(summary_l2, 0, summary_l2_size);
+    next_map += summary_l2_size;
+
+    for(unsigned int order = 0; order <= PMM_MAX_ORDER; order++){
+        buddy_map[order] = (uint64_t*)next_map;
+        memset(buddy_map[order], 0, buddy_map_size[order]);
+        next_map += buddy_map_size[order];
+    }
+
+    page_refs = (uint16_t*)next_map;
+    memset(page_refs, 0, page_refs_size);
+    next_map += page_refs_size;
+
+    //convert the virtual bitmap pointer back to a physical address
+    uint64_t meta_phys_start = (uint64_t)bitmap - hhdm_offset;
+    uint64_t meta_phys_end = meta_phys_start + meta_size;
+
+    uint64_t meta_start_pfn = meta_phys_start / PAGE_SIZE;
+    uint64_t meta_end_pfn = (meta_phys_end + PAGE_SIZE - 1) / PAGE_SIZE; //round up
+
     for (uint64_t i = 0; i < map->entry_count; i++) {
         struct limine_memmap_entry *entry = map->entries[i];
 
         if (entry->type == LIMINE_MEMMAP_USABLE) {
-            //calculate which pages this entry covers; take floor w int div
-            uint64_t start_pfn = entry->base / PAGE_SIZE;
-            uint64_t page_count = entry->length / PAGE_SIZE;
-
-            for (uint64_t j = 0; j < page_count; j++) {
-                uint64_t pfn = start_pfn + j;
-                bitmap[pfn / 8] &= ~(1 << (pfn % 8)); 
-                free_memory += PAGE_SIZE;
+            //calculate which pages this entry covers; partial pages are skipped
+            uint64_t start_pfn = (entry->base + PAGE_SIZE - 1) / PAGE_SIZE;
+            uint64_t end_pfn = (entry->base + entry->length) / PAGE_SIZE;
+
+            //keep the bitmap and buddy maps out of the allocator
+            if(start_pfn < meta_end_pfn && meta_start_pfn < end_pfn){
+                if(start_pfn < meta_start_pfn) buddy_add_range(start_pfn, meta_start_pfn);
+                if(meta_end_pfn < end_pfn) buddy_add_range(meta_end_pfn, end_pfn);
+            } else {
+                buddy_add_range(start_pfn, end_pfn);
             }
+
+            init_stats.regions++;
         }
     }
 
-    //
-    //mark bitmap back as used again
-    //
-    
-    //convert the virtual bitmap pointer back to a physical address
-    uint64_t bitmap_phys_start = (uint64_t)bitmap - hhdm_offset;
-    uint64_t bitmap_phys_end = bitmap_phys_start + bitmap_size;
-    
-    uint64_t start_pfn = bitmap_phys_start / PAGE_SIZE;
-    uint64_t end_pfn = (bitmap_phys_end + PAGE_SIZE - 1) / PAGE_SIZE; //round up
+    init_stats.pages_tracked = highest_pfn;
+    init_stats.pages_free = free_memory / PAGE_SIZE;
+    init_stats.meta_bytes = meta_size;
+    init_stats.tsc_cycles = rdtsc() - tsc_start;
+}
+
+const struct pmm_init_stats *pmm_get_init_stats(void){
+    return &init_stats;
+}
+
+static uint64_t pool_alloc_page(void){
+    if(pool_free == 0 && !pool_refill()){
+        return PMM_NO_PFN;
+    }
+
+    // pool_free > 0 guarantees some top level word is non-zero
+    uint64_t top = last_alloc_index;
+    uint64_t top_words = summary_l2_size / 8;
+    while(summary_l2[top] == 0){
+        top = (top + 1 == top_words) ? 0 : top + 1;
+    }
+    last_alloc_index = top;
 
-    for (uint64_t i = start_pfn; i < end_pfn; i++) {
-        bitmap[i / 8] |= (1 << (i % 8));
-        free_memory -= PAGE_SIZE;
+    uint64_t l1 = top * 64 + __builtin_ctzll(summary_l2[top]);
+    uint64_t word = l1 * 64 + __builtin_ctzll(summary_l1[l1]);
+    uint64_t pfn = word * 64 + __builtin_ctzll(~bitmap[word]);
+
+    BITMAP_SET(pfn);
+    if(bitmap[word] == ~0ULL){
+        summary_word_full(word);
     }
+
+    free_memory -= PAGE_SIZE;
+    pool_free--;
+    return pfn;
+}
+
+static void pool_free_page(uint64_t page_idx){
+    pool_mark_free(page_idx);
+    free_memory += PAGE_SIZE;
+    pool_free++;
+
+    // a fully free chunk goes back to the buddy once the pool has slack,
+    // so single pages don't slowly eat the contiguous memory
+    uint64_t *chunk = &bitmap[page_idx / 64];
+    if(*chunk == 0 && pool_free > PMM_POOL_HIGH){
+        *chunk = ~0ULL;
+        summary_word_full(page_idx / 64);
+        pool_free -= 64;
+        buddy_give(page_idx & ~63ULL, PMM_POOL_ORDER);
+    }
+}
+
+// Pop a frame from the zero pool, PMM_NO_PFN if it is empty
+static uint64_t zero_pool_pop(void){
+    uint64_t pfn = PMM_NO_PFN;
+
+    uint64_t flags = spin_lock_irqsave(&zero_lock);
+    if(zero_pool_count > 0){
+        pfn = zero_pool[--zero_pool_count];
+    }
+    spin_unlock_irqrestore(&zero_lock, flags);
+
+    return pfn;
+}
+
+// Zero a page with non-temporal stores, so it doesn't evict anything useful
+static void zero_page_nt(void *page){
+    uint64_t *p = (uint64_t*)page;
+
+    for(size_t i = 0; i < PAGE_SIZE / 8; i += 4){
+        __asm__ volatile(
+            "movnti %1, 0(%0)\n\t"
+            "movnti %1, 8(%0)\n\t"
+            "movnti %1, 16(%0)\n\t"
+            "movnti %1, 24(%0)"
+            :: "r"(p + i), "r"(0ULL) : "memory");
+    }
+
+    // order the weakly ordered stores before the page is published
+    __asm__ volatile("sfence" ::: "memory");
 }
 
 void *pmm_alloc_page(void){
-    for(int i=last_alloc_index; i<bitmap_size; i++){
-        if(bitmap[i] != 0xFF){
-            uint8_t freebit;
-            for(int bit=0; bit<8; bit++){
-                if(!BITMAP_TEST((i * 8 + bit))){
-                    freebit = bit;
-                    break;
-                }
-            }
-            uint64_t phys_addr = (i * 8 + freebit) * PAGE_SIZE;
-            free_memory -= 4096;
-            bitmap[i] = bitmap[i] | 1 << freebit;
+    uint64_t flags = irq_save();
+    struct pmm_pcp *mag = &pcp[cpu_id()];
+
+    if(mag->count == 0){
+        mag->stats.alloc_misses++;
+
+        spin_lock(&pmm_lock);
+        while(mag->count < PMM_PCP_BATCH){
+            uint64_t pfn = pool_alloc_page();
+            if(pfn == PMM_NO_PFN) break;
+            mag->frames[mag->count++] = pfn;
+        }
+        spin_unlock(&pmm_lock);
 
-            last_alloc_index = i;
-            return (void*)phys_addr;
+        if(mag->count == 0){
+            irq_restore(flags);
+            // last resort before OOM: a page somebody already zeroed
+            uint64_t pfn = zero_pool_pop();
+            return pfn == PMM_NO_PFN ? NULL : (void*)(pfn * PAGE_SIZE);
         }
+    } else {
+        mag->stats.alloc_hits++;
     }
 
-    for(uint64_t i = 0; i < last_alloc_index; i++){
-        if(bitmap[i] != 0xFF){
-            uint8_t freebit;
-            for(int bit=0; bit<8; bit++){
-                if(!BITMAP_TEST((i * 8 + bit))){
-                    freebit = bit;
-                    break;
-                }
-            }
-            uint64_t phys_addr = (i * 8 + freebit) * PAGE_SIZE;
-            free_memory -= 4096;
-            bitmap[i] = bitmap[i] | 1 << freebit;
+    uint64_t pfn = mag->frames[--mag->count];
+    irq_restore(flags);
+    return (void*)(pfn * PAGE_SIZE);
+}
+
+void pmm_free_page(void *page){
+    uint64_t flags = irq_save();
+    struct pmm_pcp *mag = &pcp[cpu_id()];
+
+    if(mag->count == PMM_PCP_SIZE){
+        mag->stats.free_drains++;
+
+        // give back the oldest frames, the newest ones are still cache hot
+        spin_lock(&pmm_lock);
+        for(uint32_t i = 0; i < PMM_PCP_BATCH; i++){
+            pool_free_page(mag->frames[i]);
+        }
+        spin_unlock(&pmm_lock);
+
+        mag->count -= PMM_PCP_BATCH;
+        memmove(&mag->frames[0], &mag->frames[PMM_PCP_BATCH], mag->count * sizeof(uint64_t));
+    } else {
+        mag->stats.free_hits++;
+    }
+
+    mag->frames[mag->count++] = (uint64_t)page / PAGE_SIZE;
+    irq_restore(flags);
+}
+
+void pmm_page_ref(void *page){
+    uint16_t *ref = &page_refs[(uint64_t)page / PAGE_SIZE];
+    if(__atomic_add_fetch(ref, 1, __ATOMIC_RELAXED) == 0){
+        hcf(); // 65536 sharers, the counter wrapped
+    }
+}
+
+void pmm_page_put(void *page){
+    uint16_t *ref = &page_refs[(uint64_t)page / PAGE_SIZE];
+    uint16_t refs = __atomic_load_n(ref, __ATOMIC_ACQUIRE);
 
-            last_alloc_index = i;
-            return (void*)phys_addr;
+    // drop one of the extra references; whoever finds none left owns the frame
+    while(refs != 0){
+        if(__atomic_compare_exchange_n(ref, &refs, refs - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+            return;
         }
     }
 
-    return NULL;
+    pmm_free_page(page);
 }
 
-void pmm_free_page(void *page){
-    uint64_t ipage = (uint64_t)page;
+uint32_t pmm_page_refcount(void *page){
+    return __atomic_load_n(&page_refs[(uint64_t)page / PAGE_SIZE], __ATOMIC_ACQUIRE) + 1;
+}
 
-    uint64_t page_idx = ipage / PAGE_SIZE;
-    BITMAP_UNSET(page_idx);
-    free_memory += PAGE_SIZE;
+void *pmm_alloc_zeroed_page(void){
+    uint64_t pfn = zero_pool_pop();
+
+    if(pfn != PMM_NO_PFN){
+        __atomic_fetch_add(&zero_stats.hits, 1, __ATOMIC_RELAXED);
+        return (void*)(pfn * PAGE_SIZE);
+    }
+
+    __atomic_fetch_add(&zero_stats.misses, 1, __ATOMIC_RELAXED);
+
+    void *page = pmm_alloc_page();
+    if(page){
+        memzero_page((void*)((uint64_t)page + hhdm_offset));
+    }
+    return page;
+}
+
+bool pmm_zero_idle(void){
+    if(__atomic_load_n(&zero_pool_count, __ATOMIC_RELAXED) >= PMM_ZERO_POOL_SIZE){
+        return false;
+    }
+
+    void *page = pmm_alloc_page();
+    if(!page){
+        return false;
+    }
+
+    // zero outside the lock. The vector stores need interrupts off, but
+    // only for the few hundred cycles one page takes.
+    void *virt = (void*)((uint64_t)page + hhdm_offset);
+    if(fpu_ready()){
+        kernel_fpu_begin();
+        if(fpu_has_avx()) zero_page_avx(virt);
+        else zero_page_sse2(virt);
+        kernel_fpu_end();
+    } else {
+        zero_page_nt(virt);
+    }
+
+    uint64_t flags = spin_lock_irqsave(&zero_lock);
+    bool stored = zero_pool_count < PMM_ZERO_POOL_SIZE;
+    if(stored){
+        zero_pool[zero_pool_count++] = (uint64_t)page / PAGE_SIZE;
+        zero_stats.zeroed++;
+    }
+    spin_unlock_irqrestore(&zero_lock, flags);
+
+    // someone else filled the last slot while we were zeroing
+    if(!stored){
+        pmm_free_page(page);
+    }
+
+    return stored;
+}
+
+void pmm_get_zero_stats(struct pmm_zero_stats *out){
+    uint64_t flags = spin_lock_irqsave(&zero_lock);
+    *out = zero_stats;
+    out->depth = zero_pool_count;
+    spin_unlock_irqrestore(&zero_lock, flags);
+}
+
+size_t pmm_reclaim_bootloader(struct limine_memmap_response *map){
+    static bool reclaimed = false;
+    if(reclaimed){
+        return 0;
+    }
+    reclaimed = true;
+
+    // the memmap itself sits in reclaimable memory, and the buddy writes its
+    // list nodes into freed blocks, so copy the ranges out before freeing any
+    struct reclaim_range {
+        uint64_t start, end;
+    };
+    struct reclaim_range stack_ranges[PMM_RECLAIM_MAX_RANGES];
+    struct reclaim_range *range = stack_ranges;
+    size_t max_ranges = PMM_RECLAIM_MAX_RANGES;
+
+    size_t wanted = 0;
+    for(uint64_t i = 0; i < map->entry_count; i++){
+        if(map->entries[i]->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE) wanted++;
+    }
+
+    // more than the stack holds: borrow pages for the list, from memory
+    // that is already usable
+    unsigned int buffer_order = 0;
+    void *buffer = NULL;
+    if(wanted > max_ranges){
+        while(buffer_order < PMM_MAX_ORDER &&
+              (PAGE_SIZE << buffer_order) / sizeof(struct reclaim_range) < wanted){
+            buffer_order++;
+        }
+        buffer = pmm_alloc_pages(buffer_order);
+        if(buffer){
+            range = (struct reclaim_range*)((uint64_t)buffer + hhdm_offset);
+            max_ranges = (PAGE_SIZE << buffer_order) / sizeof(struct reclaim_range);
+        }
+    }
+    if(wanted > max_ranges){
+        debug_print("PMM: only reclaiming ");
+        debug_print_dec(max_ranges);
+        debug_print(" of ");
+        debug_print_dec(wanted);
+        debug_print(" bootloader ranges\n");
+    }
+
+    size_t ranges = 0;
+    for(uint64_t i = 0; i < map->entry_count && ranges < max_ranges; i++){
+        struct limine_memmap_entry *entry = map->entries[i];
+
+        if(entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE){
+            range[ranges].start = (entry->base + PAGE_SIZE - 1) / PAGE_SIZE;
+            range[ranges].end = (entry->base + entry->length) / PAGE_SIZE;
+            ranges++;
+        }
+    }
+
+    size_t before = free_memory;
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    for(size_t i = 0; i < ranges; i++){
+        buddy_add_range(range[i].start, range[i].end);
+    }
+    size_t pages = (free_memory - before) / PAGE_SIZE;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    if(buffer) pmm_free_pages(buffer, buffer_order);
+
+    return pages;
+}
+
+void *pmm_alloc_pages(unsigned int order){
+    if(order > PMM_MAX_ORDER){
+        return NULL;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    uint64_t pfn = buddy_take(order);
+    if(pfn != PMM_NO_PFN){
+        free_memory -= PAGE_SIZE << order;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    if(pfn == PMM_NO_PFN){
+        return NULL;
+    }
+
+    return (void*)(pfn * PAGE_SIZE);
+}
+
+void pmm_free_pages(void *ptr, unsigned int order){
+    uint64_t pfn = (uint64_t)ptr / PAGE_SIZE;
+
+    if(order > PMM_MAX_ORDER || (pfn & ((1ULL << order) - 1))){
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    // double free, refuse rather than corrupt the lists
+    if(!BUDDY_TEST(order, pfn)){
+        buddy_give(pfn, order);
+        free_memory += PAGE_SIZE << order;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
 }
 
 size_t pmm_get_free_page_count(void){
-    return free_memory / PAGE_SIZE;
+    // pages parked in the magazines and the zero pool are free too
+    size_t cached = 0;
+    for(uint32_t cpu = 0; cpu < MAX_CPUS; cpu++){
+        cached += __atomic_load_n(&pcp[cpu].count, __ATOMIC_RELAXED);
+    }
+
+    return free_memory / PAGE_SIZE + cached + zero_pool_count;
+}
+
+void pmm_get_pcp_stats(uint32_t cpu, struct pmm_pcp_stats *out){
+    if(cpu >= MAX_CPUS){
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+
+    *out = pcp[cpu].stats;
+    out->cached = pcp[cpu].count;
 }
\ No newline at end of file
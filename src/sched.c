@@ -0,0 +1,447 @@
+#include <sched.h>
+#include <smp.h>
+#include <apic.h>
+#include <idt.h>
+#include <gdt.h>
+#include <fpu.h>
+#include <vmspace.h>
+#include <vmalloc.h>
+#include <slab.h>
+#include <syscall.h>
+#include <util.h>
+
+//
+// Every CPU has one run queue per priority. A queue is a fixed ring: only
+// the owning CPU pushes (at bottom, with interrupts off), and anyone takes
+// from top with a CAS, the owner in FIFO order for round robin and idle
+// CPUs to steal the oldest thread. Nobody ever locks another CPU's queue.
+// Threads that don't fit wait on the owner's overflow list, which only the
+// owner touches, and move into the ring as it drains.
+//
+
+#define RUNQ_MASK (RUNQ_SIZE - 1)
+
+// thread->on_cpu. A thread woken before it got off its CPU is never queued
+// from the outside, nobody may switch to a stack still in use; the waker
+// marks it and the CPU queues it itself once it has switched away.
+#define OFF_CPU       0
+#define ON_CPU        1
+#define ON_CPU_WOKEN  2
+
+struct runq {
+    uint64_t top __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint64_t bottom __attribute__((aligned(CACHE_LINE_SIZE)));
+    struct thread *slots[RUNQ_SIZE];
+};
+
+struct sched_cpu {
+    struct runq rq[SCHED_PRIORITIES];
+    struct thread *overflow[SCHED_PRIORITIES], *overflow_tail[SCHED_PRIORITIES];
+    uint64_t overflowed;        // Threads on the overflow lists
+    struct thread *prev;        // Thread we just switched away from
+    bool requeue_prev;          // It was still runnable
+    uint64_t switch_start;
+    struct sched_stats stats;
+};
+
+static struct sched_cpu *sched_cpus[MAX_CPUS];
+static uint32_t next_tid = 0;
+
+extern void switch_context(uint64_t *prev_rsp, uint64_t next_rsp);
+
+static bool runq_push(struct runq *q, struct thread *t){
+    uint64_t bottom = q->bottom;
+    uint64_t top = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    if(bottom - top >= RUNQ_SIZE) return false;
+
+    __atomic_store_n(&q->slots[bottom & RUNQ_MASK], t, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static struct thread *runq_take(struct runq *q){
+    uint64_t top = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    for(;;){
+        uint64_t bottom = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+        if(top >= bottom) return NULL;
+
+        // the owner can't reuse this slot until top moves past it, and then
+        // the CAS fails
+        struct thread *t = __atomic_load_n(&q->slots[top & RUNQ_MASK], __ATOMIC_RELAXED);
+        if(__atomic_compare_exchange_n(&q->top, &top, top + 1, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+            return t;
+        }
+    }
+}
+
+// Highest priority first, down to limit
+static struct thread *runq_pick(struct sched_cpu *sc, uint32_t limit){
+    for(uint32_t prio = 0; prio <= limit; prio++){
+        struct thread *t = runq_take(&sc->rq[prio]);
+        if(t) return t;
+    }
+    return NULL;
+}
+
+static struct thread *steal(uint32_t self, uint32_t limit){
+    uint32_t cpus = smp_cpu_count();
+    for(uint32_t i = 1; i < cpus; i++){
+        struct sched_cpu *victim = __atomic_load_n(&sched_cpus[(self + i) % cpus], __ATOMIC_ACQUIRE);
+        if(!victim) continue;
+
+        struct thread *t = runq_pick(victim, limit);
+        if(t){
+            sched_cpus[self]->stats.steals++;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+// Owner, interrupts off: move overflowed threads into the ring while it
+// has room, oldest first
+static void overflow_drain(struct sched_cpu *sc, uint32_t prio){
+    struct thread *t;
+    while((t = sc->overflow[prio]) && runq_push(&sc->rq[prio], t)){
+        sc->overflow[prio] = t->run_next;
+        __atomic_store_n(&sc->overflowed, sc->overflowed - 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Owner, interrupts off
+static struct thread *local_pick(struct sched_cpu *sc, uint32_t limit){
+    for(uint32_t prio = 0; prio <= limit; prio++){
+        overflow_drain(sc, prio);
+    }
+    return runq_pick(sc, limit);
+}
+
+// Interrupts off
+static void enqueue(struct sched_cpu *sc, struct thread *t){
+    uint32_t prio = t->priority;
+    overflow_drain(sc, prio);
+    if(!sc->overflow[prio] && runq_push(&sc->rq[prio], t)) return;
+
+    // behind the ones already waiting, so the order stays FIFO
+    t->run_next = NULL;
+    if(sc->overflow[prio]){
+        sc->overflow_tail[prio]->run_next = t;
+    } else {
+        sc->overflow[prio] = t;
+    }
+    sc->overflow_tail[prio] = t;
+    __atomic_store_n(&sc->overflowed, sc->overflowed + 1, __ATOMIC_RELAXED);
+}
+
+static void thread_free(struct thread *t){
+    if(t->fpu) fpu_state_free(t->fpu);
+    if(t->space) vmspace_destroy(t->space);
+    kstack_free(t->stack);
+    kfree(t);
+}
+
+// First thing on the new stack: finish what schedule() left for us
+static void finish_switch(void){
+    struct sched_cpu *sc = sched_cpus[cpu_id()];
+    struct thread *prev = sc->prev;
+
+    uint64_t cycles = rdtsc() - sc->switch_start;
+    sc->stats.switches++;
+    sc->stats.switch_cycles += cycles;
+    if(cycles > sc->stats.switch_cycles_max) sc->stats.switch_cycles_max = cycles;
+
+    bool requeue = sc->requeue_prev;
+    bool dead = prev->state == THREAD_DEAD;
+    sc->requeue_prev = false;
+
+    // off its stack now, another CPU may run it
+    if(__atomic_exchange_n(&prev->on_cpu, OFF_CPU, __ATOMIC_ACQ_REL) == ON_CPU_WOKEN){
+        requeue = true;
+    }
+
+    if(requeue) enqueue(sc, prev);
+    if(dead) thread_free(prev);
+}
+
+// A thread just moved from blocked to ready: true if it is off its CPU and
+// the caller has to queue or run it, false if its CPU will queue it
+static bool claim_woken(struct thread *t){
+    uint32_t expected = ON_CPU;
+    return !__atomic_compare_exchange_n(&t->on_cpu, &expected, ON_CPU_WOKEN, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// next is queued or claimed, so off every CPU
+static void context_switch(struct cpu *cpu, struct sched_cpu *sc, struct thread *prev, struct thread *next){
+    if(next != cpu->idle) next->state = THREAD_RUNNING;
+    __atomic_store_n(&next->on_cpu, ON_CPU, __ATOMIC_RELAXED);
+    cpu->current = next;
+    sc->prev = prev;
+
+    fpu_switch(next->fpu);
+
+    // never leave a user space loaded under a kernel thread, its owner may
+    // exit and free it
+    struct vm_space *space = next->space;
+    if(!space && prev->space) space = &kernel_space;
+    if(space && space != vmspace_current()) vmspace_switch(space);
+
+    // where SYSCALL and interrupts from ring 3 land
+    if(next->stack){
+        cpu->kernel_stack = (uint64_t)next->stack;
+        tss_set_stack((uint64_t)next->stack);
+    }
+
+    switch_context(&prev->rsp, next->rsp);
+    finish_switch();
+}
+
+// Interrupts off. preempt counts the switch as involuntary.
+static void schedule(bool preempt){
+    struct cpu *cpu = this_cpu();
+    struct sched_cpu *sc = sched_cpus[cpu->id];
+    struct thread *prev = cpu->current;
+
+    cpu->need_resched = false;
+    sc->switch_start = rdtsc();
+
+    // woken before it could block, it just keeps running
+    uint32_t woken = ON_CPU_WOKEN;
+    if(prev->state == THREAD_READY &&
+       __atomic_compare_exchange_n(&prev->on_cpu, &woken, ON_CPU, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+        prev->state = THREAD_RUNNING;
+    }
+
+    // a running thread only gives way to its own priority or better; one
+    // that can't run takes anything, from other CPUs too before going idle
+    bool runnable = prev->state == THREAD_RUNNING;
+    uint32_t limit = runnable ? prev->priority : SCHED_PRIORITIES - 1;
+
+    struct thread *next = local_pick(sc, limit);
+    if(!next && !runnable) next = steal(cpu->id, limit);
+    if(!next){
+        if(runnable || prev == cpu->idle) return;
+        next = cpu->idle;
+    }
+
+    if(runnable){
+        prev->state = THREAD_READY;
+        sc->requeue_prev = true;
+    }
+    if(preempt) sc->stats.preemptions++;
+
+    context_switch(cpu, sc, prev, next);
+}
+
+// A new thread's stack starts out as if switch_context had been called from here
+static void thread_start(void){
+    finish_switch();
+    __asm__ volatile("sti");
+
+    struct thread *self = thread_current();
+    self->entry(self->arg);
+    thread_exit();
+}
+
+struct thread *thread_create(const char *name, void (*entry)(void *arg), void *arg, uint8_t priority){
+    if(priority >= SCHED_PRIORITIES) return NULL;
+
+    struct thread *t = kmalloc(sizeof(struct thread));
+    if(!t) return NULL;
+    memset(t, 0, sizeof(struct thread));
+
+    t->stack = kstack_alloc();
+    if(!t->stack){
+        kfree(t);
+        return NULL;
+    }
+
+    // switch_context pops six registers, then returns into thread_start; the
+    // zero above that is its return address and keeps rsp % 16 == 8 on entry
+    uint64_t *sp = (uint64_t*)t->stack;
+    *--sp = 0;
+    *--sp = (uint64_t)thread_start;
+    for(int i = 0; i < 6; i++) *--sp = 0;
+    t->rsp = (uint64_t)sp;
+
+    t->state = THREAD_BLOCKED;
+    t->tid = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+    t->priority = priority;
+    t->entry = entry;
+    t->arg = arg;
+    t->name = name;
+    return t;
+}
+
+static void user_thread_start(void *arg){
+    (void)arg;
+    struct thread *self = thread_current();
+    user_enter(self->user_rip, self->user_rsp, (uint64_t)self->arg);
+}
+
+struct thread *thread_create_user(const char *name, struct vm_space *space, uint64_t rip,
+                                  uint64_t rsp, uint64_t arg, uint8_t priority){
+    if(space == NULL) return NULL;
+
+    // user code may use SSE at any time
+    struct fpu_state *fpu = fpu_state_alloc();
+    if(!fpu) return NULL;
+
+    struct thread *t = thread_create(name, user_thread_start, (void*)arg, priority);
+    if(!t){
+        fpu_state_free(fpu);
+        return NULL;
+    }
+
+    t->fpu = fpu;
+    t->space = space;
+    t->user_rip = rip;
+    t->user_rsp = rsp;
+    return t;
+}
+
+void thread_destroy(struct thread *t){
+    if(t == NULL) return;
+
+    // nothing can reference it yet, no CPU has been on its stack
+    if(t->state != THREAD_BLOCKED || t->on_cpu != OFF_CPU) hcf();
+    thread_free(t);
+}
+
+void thread_exit(void){
+    __asm__ volatile("cli");
+    thread_current()->state = THREAD_DEAD;
+    schedule(false);
+    __builtin_unreachable();
+}
+
+void yield(void){
+    uint64_t flags = irq_save();
+    sched_cpus[cpu_id()]->stats.yields++;
+    schedule(false);
+    irq_restore(flags);
+}
+
+void thread_set_blocked(void){
+    __atomic_store_n(&thread_current()->state, THREAD_BLOCKED, __ATOMIC_SEQ_CST);
+}
+
+void thread_block(void){
+    uint64_t flags = irq_save();
+    schedule(false);
+    irq_restore(flags);
+}
+
+bool thread_wake(struct thread *t){
+    uint32_t expected = THREAD_BLOCKED;
+    if(!__atomic_compare_exchange_n(&t->state, &expected, THREAD_READY, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+        return false;
+    }
+    if(!claim_woken(t)) return true;
+
+    // onto our own queue, an idle CPU steals it if we stay busy
+    uint64_t flags = irq_save();
+    struct cpu *cpu = this_cpu();
+    enqueue(sched_cpus[cpu->id], t);
+    if(t->priority < cpu->current->priority) cpu->need_resched = true;
+    irq_restore(flags);
+    return true;
+}
+
+void sched_switch_to(struct thread *next){
+    // someone else woke it, or it hasn't left its CPU yet: whoever queues
+    // it does, we just block
+    uint32_t expected = THREAD_BLOCKED;
+    if(!__atomic_compare_exchange_n(&next->state, &expected, THREAD_READY, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) || !claim_woken(next)){
+        schedule(false);
+        return;
+    }
+
+    struct cpu *cpu = this_cpu();
+    struct sched_cpu *sc = sched_cpus[cpu->id];
+    struct thread *prev = cpu->current;
+
+    sc->switch_start = rdtsc();
+    sc->stats.handoffs++;
+
+    // a blocked caller stays off the queues until it is woken or claimed
+    if(prev->state == THREAD_RUNNING){
+        prev->state = THREAD_READY;
+        sc->requeue_prev = true;
+    }
+
+    context_switch(cpu, sc, prev, next);
+}
+
+void sched_preempt(void){
+    struct cpu *cpu = this_cpu();
+    if(!cpu->need_resched || cpu->preempt_count || cpu->current == NULL) return;
+    schedule(true);
+}
+
+// Every tick ends the time slice; schedule() keeps the thread if nobody
+// of its priority is waiting
+static void sched_tick(struct interrupt_frame *frame, void *ctx){
+    (void)frame;
+    (void)ctx;
+    struct cpu *cpu = this_cpu();
+    if(cpu->current == NULL) return;
+
+    sched_cpus[cpu->id]->stats.ticks++;
+    cpu->need_resched = true;
+}
+
+void sched_init_cpu(void){
+    struct cpu *cpu = this_cpu();
+
+    // the queues are too big for a slab and want cache-line alignment
+    struct sched_cpu *sc = vmalloc(sizeof(struct sched_cpu));
+    struct thread *idle = kmalloc(sizeof(struct thread));
+    if(!sc || !idle){
+        debug_print("Failed to allocate the scheduler\n");
+        hcf();
+    }
+    memset(sc, 0, sizeof(struct sched_cpu));
+    memset(idle, 0, sizeof(struct thread));
+
+    // the code running now becomes the idle thread
+    idle->state = THREAD_IDLE;
+    idle->tid = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+    idle->priority = SCHED_PRIORITIES;  // Below everything
+    idle->on_cpu = ON_CPU;
+    idle->name = "idle";
+
+    uint64_t flags = irq_save();
+    cpu->idle = idle;
+    cpu->current = idle;
+    __atomic_store_n(&sched_cpus[cpu->id], sc, __ATOMIC_RELEASE);
+    irq_restore(flags);
+
+    if(!apic_timer_start(SCHED_HZ) && cpu->id == 0){
+        debug_print("No APIC timer, threads only switch when they yield\n");
+    }
+}
+
+void sched_init(void){
+    irq_register(APIC_TIMER_VECTOR, sched_tick, NULL);
+    sched_init_cpu();
+}
+
+void sched_get_stats(uint32_t cpu, struct sched_stats *out){
+    struct sched_cpu *sc = __atomic_load_n(&sched_cpus[cpu], __ATOMIC_ACQUIRE);
+    if(!sc){
+        memset(out, 0, sizeof(struct sched_stats));
+        return;
+    }
+
+    *out = sc->stats;
+    out->runnable = __atomic_load_n(&sc->overflowed, __ATOMIC_RELAXED);
+    for(int prio = 0; prio < SCHED_PRIORITIES; prio++){
+        out->runnable += __atomic_load_n(&sc->rq[prio].bottom, __ATOMIC_RELAXED) -
+                         __atomic_load_n(&sc->rq[prio].top, __ATOMIC_RELAXED);
+    }
+}
\ No newline at end of file
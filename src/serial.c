@@ -0,0 +1,169 @@
+#include <serial.h>
+#include <util.h>
+#include <apic.h>
+#include <idt.h>
+#include <work.h>
+
+#define UART_DATA (SERIAL_PORT + 0)
+#define UART_IER  (SERIAL_PORT + 1)
+#define UART_IIR  (SERIAL_PORT + 2)
+#define UART_FCR  (SERIAL_PORT + 2)
+#define UART_LCR  (SERIAL_PORT + 3)
+#define UART_MCR  (SERIAL_PORT + 4)
+#define UART_LSR  (SERIAL_PORT + 5)
+
+#define IER_THRE  0x02          // Interrupt when the transmit FIFO empties
+#define LSR_THRE  0x20          // Transmit FIFO empty
+
+#define SERIAL_IRQ 4
+
+//
+// Multi-producer ring. A writer reserves space by moving ring_head with a
+// CAS, then fills its slots; a slot carries SLOT_FULL next to the byte so the
+// reader can tell a written slot from a reserved one without any lock. The
+// one reader (whoever holds drain_busy) clears slots and moves ring_tail.
+//
+
+#define SLOT_FULL 0x100
+#define RING_MASK (SERIAL_RING_SIZE - 1)
+
+static uint16_t ring[SERIAL_RING_SIZE];
+static uint64_t ring_head = 0;  // Next slot to reserve
+static uint64_t ring_tail = 0;  // Next slot to send
+static bool drain_busy = false;
+static bool sync_mode = false;
+static struct serial_stats stats;
+
+void serial_init() {
+    outb(UART_IER, 0x00);    // Disable all interrupts
+    outb(UART_LCR, 0x80);    // Enable DLAB (set baud rate divisor)
+    outb(UART_DATA, 0x03);   // Set divisor to 3 (lo byte) 38400 baud
+    outb(UART_IER, 0x00);    //                  (hi byte)
+    outb(UART_LCR, 0x03);    // 8 bits, no parity, one stop bit
+    outb(UART_FCR, 0xC7);    // Enable FIFO, clear them, with 14-byte threshold
+    outb(UART_MCR, 0x0B);    // IRQs enabled, RTS/DSR set
+}
+
+static void ring_put(const char *str, size_t len) {
+    uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    do {
+        uint64_t tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+        if (head - tail + len > SERIAL_RING_SIZE) {
+            __atomic_fetch_add(&stats.dropped, len, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&ring_head, &head, head + len, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    for (size_t i = 0; i < len; i++) {
+        __atomic_store_n(&ring[(head + i) & RING_MASK], SLOT_FULL | (uint8_t)str[i], __ATOMIC_RELEASE);
+    }
+    __atomic_fetch_add(&stats.queued, len, __ATOMIC_RELAXED);
+}
+
+// Reader only. False once the next slot is empty or not written yet.
+static bool ring_pop(uint8_t *c) {
+    uint64_t tail = ring_tail;
+    uint16_t slot = __atomic_load_n(&ring[tail & RING_MASK], __ATOMIC_ACQUIRE);
+    if (!(slot & SLOT_FULL)) return false;
+
+    *c = (uint8_t)slot;
+    __atomic_store_n(&ring[tail & RING_MASK], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring_tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static inline bool ring_ready(void) {
+    return __atomic_load_n(&ring[ring_tail & RING_MASK], __ATOMIC_ACQUIRE) & SLOT_FULL;
+}
+
+// Refill the transmit FIFO if it is empty. The next THR-empty interrupt
+// comes once those bytes are out and continues from there.
+static void serial_drain(void) {
+    do {
+        if (__atomic_exchange_n(&drain_busy, true, __ATOMIC_ACQUIRE)) return;
+
+        if (inb(UART_LSR) & LSR_THRE) {
+            uint8_t c;
+            for (int i = 0; i < SERIAL_FIFO_SIZE && ring_pop(&c); i++) {
+                outb(UART_DATA, c);
+            }
+        }
+
+        __atomic_store_n(&drain_busy, false, __ATOMIC_RELEASE);
+
+        // a writer that found us busy left its bytes for us
+    } while (ring_ready() && (inb(UART_LSR) & LSR_THRE));
+}
+
+static void serial_flush_sync(void) {
+    uint8_t c;
+    while (ring_pop(&c)) {
+        while ((inb(UART_LSR) & LSR_THRE) == 0);
+        outb(UART_DATA, c);
+    }
+}
+
+void serial_sync(void) {
+    __atomic_store_n(&sync_mode, true, __ATOMIC_SEQ_CST);
+    outb(UART_IER, 0x00);
+
+    // whoever was draining isn't coming back to finish
+    __atomic_store_n(&drain_busy, true, __ATOMIC_SEQ_CST);
+    serial_flush_sync();
+}
+
+static void serial_drain_work(void *ctx) {
+    (void)ctx;
+    serial_drain();
+}
+
+static struct work drain_work = WORK_INIT(serial_drain_work, NULL);
+
+// THR empty: ack it and refill the FIFO from a work item, the port I/O for
+// 16 bytes is too slow to do with interrupts off
+static void serial_irq(struct interrupt_frame *frame, void *ctx) {
+    (void)frame;
+    (void)ctx;
+    __atomic_fetch_add(&stats.irqs, 1, __ATOMIC_RELAXED);
+    inb(UART_IIR);              // Reading IIR acknowledges THR-empty
+    work_queue(&drain_work);
+}
+
+void serial_enable_irq(void) {
+    irq_register(IRQ_VECTOR_BASE + SERIAL_IRQ, serial_irq, NULL);
+    outb(UART_IER, IER_THRE);
+    irq_enable(SERIAL_IRQ);
+}
+
+static void serial_write(const char *str, size_t len) {
+    if (__atomic_load_n(&sync_mode, __ATOMIC_RELAXED)) {
+        // queued bytes first, so the output stays in order
+        serial_flush_sync();
+        for (size_t i = 0; i < len; i++) {
+            while ((inb(UART_LSR) & LSR_THRE) == 0);
+            outb(UART_DATA, str[i]);
+        }
+        return;
+    }
+
+    ring_put(str, len);
+    serial_drain();
+}
+
+void debug_putc(char c) {
+    serial_write(&c, 1);
+}
+
+void debug_print(const char* str) {
+    size_t len = 0;
+    while (str[len] != '\0') len++;
+
+    serial_write(str, len);
+}
+
+void serial_get_stats(struct serial_stats *out) {
+    out->queued = __atomic_load_n(&stats.queued, __ATOMIC_RELAXED);
+    out->dropped = __atomic_load_n(&stats.dropped, __ATOMIC_RELAXED);
+    out->irqs = __atomic_load_n(&stats.irqs, __ATOMIC_RELAXED);
+}
\ No newline at end of file
@@ -0,0 +1,367 @@
+#include <slab.h>
+#include <pmm.h>
+#include <util.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <stdbool.h>
+
+extern uint64_t hhdm_offset;
+
+//
+// Slab allocator
+//
+// A slab is one naturally aligned SLAB_SIZE block from the buddy with a
+// struct slab header in its first cache line, so the header of any object is
+// found by masking the pointer. Large kmalloc blocks carry the same header
+// (with cache == NULL), which lets kfree() tell the two apart.
+//
+// Each cache has a per-CPU array of free objects in front of its slabs; the
+// owning CPU uses it with interrupts off and only takes the cache lock to move
+// KMEM_CPU_CACHE_BATCH objects to or from the slabs.
+//
+
+#define SLAB_SIZE (PAGE_SIZE << SLAB_ORDER)
+#define SLAB_MAGIC 0x42414C534152414BULL
+
+struct slab {
+    uint64_t magic;
+    struct kmem_cache *cache;   // NULL for a large kmalloc block
+    struct slab *next;
+    struct slab *prev;
+    void *free;                 // Free objects in this slab
+    uint32_t inuse;             // Objects out of this slab (incl. per-CPU lists)
+    uint32_t order;             // Block order, large kmalloc blocks only
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct kmem_cpu_cache {
+    uint32_t count;
+    void *objs[KMEM_CPU_CACHE_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct kmem_cache {
+    struct kmem_cpu_cache cpu[MAX_CPUS];
+
+    spinlock_t lock;
+    const char *name;
+    size_t size;
+    size_t stride;
+    size_t offset;              // First object, after the header
+    size_t free_offset;         // Where the free list link lives in an object
+    uint32_t objs_per_slab;
+    void (*ctor)(void *);
+
+    struct slab *partial;
+    struct slab *full;
+    struct slab *empty;
+    uint64_t slabs;
+    uint64_t empty_slabs;
+    uint64_t inuse;
+
+    struct kmem_cache *next_cache;
+};
+
+// Size classes for kmalloc, KMALLOC_MIN_SLAB up to KMALLOC_MAX_SLAB
+#define KMALLOC_CLASSES 8
+static struct kmem_cache kmalloc_caches[KMALLOC_CLASSES];
+static const char *kmalloc_names[KMALLOC_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
+
+static struct kmem_cache *cache_list = NULL;
+static spinlock_t cache_list_lock = SPINLOCK_INIT;
+
+#define ALIGN_UP_TO(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+static inline struct slab *obj_to_slab(void *obj){
+    return (struct slab*)((uint64_t)obj & ~(uint64_t)(SLAB_SIZE - 1));
+}
+
+static inline void **free_link(struct kmem_cache *cache, void *obj){
+    return (void**)((uint8_t*)obj + cache->free_offset);
+}
+
+static void slab_list_push(struct slab **head, struct slab *slab){
+    slab->prev = NULL;
+    slab->next = *head;
+    if(slab->next) slab->next->prev = slab;
+    *head = slab;
+}
+
+static void slab_list_remove(struct slab **head, struct slab *slab){
+    if(slab->prev) slab->prev->next = slab->next;
+    else *head = slab->next;
+    if(slab->next) slab->next->prev = slab->prev;
+}
+
+static bool cache_setup(struct kmem_cache *cache, const char *name, size_t size, size_t align, void (*ctor)(void *)){
+    if(align < 8) align = 8;
+    if(size == 0 || (align & (align - 1))) return false;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->name = name;
+    cache->size = size;
+    cache->ctor = ctor;
+
+    // with a constructor the object must stay intact while free, so the
+    // free list link goes behind it instead of over its first word
+    cache->free_offset = ctor ? ALIGN_UP_TO(size, 8) : 0;
+    size_t raw = ctor ? cache->free_offset + sizeof(void*) : size;
+    if(raw < sizeof(void*)) raw = sizeof(void*);
+
+    cache->stride = ALIGN_UP_TO(raw, align);
+    cache->offset = ALIGN_UP_TO(sizeof(struct slab), align);
+    if(cache->offset + cache->stride > SLAB_SIZE) return false;
+    cache->objs_per_slab = (SLAB_SIZE - cache->offset) / cache->stride;
+
+    uint64_t flags = spin_lock_irqsave(&cache_list_lock);
+    cache->next_cache = cache_list;
+    cache_list = cache;
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+
+    return true;
+}
+
+// Get a fresh slab from the buddy and thread all its objects on the free list
+static struct slab *slab_create(struct kmem_cache *cache){
+    void *phys = pmm_alloc_pages(SLAB_ORDER);
+    if(!phys) return NULL;
+
+    struct slab *slab = (struct slab*)((uint64_t)phys + hhdm_offset);
+    slab->magic = SLAB_MAGIC;
+    slab->cache = cache;
+    slab->free = NULL;
+    slab->inuse = 0;
+    slab->order = SLAB_ORDER;
+
+    // build the list back to front so objects go out in address order
+    uint8_t *base = (uint8_t*)slab + cache->offset;
+    for(uint32_t i = cache->objs_per_slab; i > 0; i--){
+        void *obj = base + (i - 1) * cache->stride;
+        if(cache->ctor) cache->ctor(obj);
+        *free_link(cache, obj) = slab->free;
+        slab->free = obj;
+    }
+
+    cache->slabs++;
+    return slab;
+}
+
+// Move up to KMEM_CPU_CACHE_BATCH objects from the slabs into cpu_cache
+static void cache_refill(struct kmem_cache *cache, struct kmem_cpu_cache *cpu_cache){
+    spin_lock(&cache->lock);
+
+    while(cpu_cache->count < KMEM_CPU_CACHE_BATCH){
+        struct slab *slab = cache->partial;
+
+        if(!slab && cache->empty){
+            slab = cache->empty;
+            slab_list_remove(&cache->empty, slab);
+            slab_list_push(&cache->partial, slab);
+            cache->empty_slabs--;
+        }
+
+        if(!slab){
+            slab = slab_create(cache);
+            if(!slab) break;
+            slab_list_push(&cache->partial, slab);
+        }
+
+        // drain this slab as far as the batch allows
+        while(slab->free && cpu_cache->count < KMEM_CPU_CACHE_BATCH){
+            void *obj = slab->free;
+            slab->free = *free_link(cache, obj);
+            slab->inuse++;
+            cache->inuse++;
+            cpu_cache->objs[cpu_cache->count++] = obj;
+        }
+
+        if(!slab->free){
+            slab_list_remove(&cache->partial, slab);
+            slab_list_push(&cache->full, slab);
+        }
+    }
+
+    spin_unlock(&cache->lock);
+}
+
+// Give the oldest KMEM_CPU_CACHE_BATCH objects of cpu_cache back to their slabs
+static void cache_flush(struct kmem_cache *cache, struct kmem_cpu_cache *cpu_cache){
+    spin_lock(&cache->lock);
+
+    for(uint32_t i = 0; i < KMEM_CPU_CACHE_BATCH; i++){
+        void *obj = cpu_cache->objs[i];
+        struct slab *slab = obj_to_slab(obj);
+
+        if(!slab->free){
+            slab_list_remove(&cache->full, slab);
+            slab_list_push(&cache->partial, slab);
+        }
+
+        *free_link(cache, obj) = slab->free;
+        slab->free = obj;
+        slab->inuse--;
+        cache->inuse--;
+
+        if(slab->inuse == 0){
+            slab_list_remove(&cache->partial, slab);
+
+            if(cache->empty_slabs < KMEM_MAX_EMPTY_SLABS){
+                slab_list_push(&cache->empty, slab);
+                cache->empty_slabs++;
+            } else {
+                slab->magic = 0;
+                cache->slabs--;
+                pmm_free_pages((void*)((uint64_t)slab - hhdm_offset), SLAB_ORDER);
+            }
+        }
+    }
+
+    spin_unlock(&cache->lock);
+
+    cpu_cache->count -= KMEM_CPU_CACHE_BATCH;
+    memmove(&cpu_cache->objs[0], &cpu_cache->objs[KMEM_CPU_CACHE_BATCH], cpu_cache->count * sizeof(void*));
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *)){
+    struct kmem_cache *cache = kmalloc(sizeof(struct kmem_cache));
+    if(!cache) return NULL;
+
+    if(!cache_setup(cache, name, size, align, ctor)){
+        kfree(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache){
+    uint64_t flags = irq_save();
+    struct kmem_cpu_cache *cpu_cache = &cache->cpu[cpu_id()];
+
+    if(cpu_cache->count == 0){
+        cache_refill(cache, cpu_cache);
+    }
+
+    void *obj = NULL;
+    if(cpu_cache->count > 0){
+        obj = cpu_cache->objs[--cpu_cache->count];
+    }
+
+    irq_restore(flags);
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj){
+    uint64_t flags = irq_save();
+    struct kmem_cpu_cache *cpu_cache = &cache->cpu[cpu_id()];
+
+    if(cpu_cache->count == KMEM_CPU_CACHE_SIZE){
+        cache_flush(cache, cpu_cache);
+    }
+    cpu_cache->objs[cpu_cache->count++] = obj;
+
+    irq_restore(flags);
+}
+
+void *kmalloc(size_t size){
+    if(size == 0) return NULL;
+
+    if(size <= KMALLOC_MAX_SLAB){
+        unsigned int idx = 0;
+        while((size_t)(KMALLOC_MIN_SLAB << idx) < size){
+            idx++;
+        }
+        return kmem_cache_alloc(&kmalloc_caches[idx]);
+    }
+
+    // too big for a slab: a buddy block of its own, header in front
+    unsigned int order = SLAB_ORDER;
+    while(((size_t)PAGE_SIZE << order) < size + sizeof(struct slab)){
+        if(++order > PMM_MAX_ORDER) return NULL;
+    }
+
+    void *phys = pmm_alloc_pages(order);
+    if(!phys) return NULL;
+
+    struct slab *block = (struct slab*)((uint64_t)phys + hhdm_offset);
+    memset(block, 0, sizeof(struct slab));
+    block->magic = SLAB_MAGIC;
+    block->order = order;
+
+    return (uint8_t*)block + sizeof(struct slab);
+}
+
+void kfree(void *ptr){
+    if(!ptr) return;
+
+    struct slab *slab = obj_to_slab(ptr);
+    if(slab->magic != SLAB_MAGIC){
+        hcf(); // Panic: not a kmalloc pointer, or the slab header got trampled
+    }
+
+    if(slab->cache){
+        kmem_cache_free(slab->cache, ptr);
+        return;
+    }
+
+    slab->magic = 0;
+    pmm_free_pages((void*)((uint64_t)slab - hhdm_offset), slab->order);
+}
+
+void slab_init(void){
+    for(unsigned int i = 0; i < KMALLOC_CLASSES; i++){
+        size_t size = KMALLOC_MIN_SLAB << i;
+        // power of two strides: small objects never straddle a cache line,
+        // 64 bytes and up start on one
+        size_t align = size < KMEM_ALIGN_CACHE_LINE ? size : KMEM_ALIGN_CACHE_LINE;
+        if(!cache_setup(&kmalloc_caches[i], kmalloc_names[i], size, align, NULL)){
+            hcf();
+        }
+    }
+}
+
+void kmem_cache_get_stats(struct kmem_cache *cache, struct kmem_cache_stats *out){
+    uint64_t cached = 0;
+    for(uint32_t cpu = 0; cpu < MAX_CPUS; cpu++){
+        cached += __atomic_load_n(&cache->cpu[cpu].count, __ATOMIC_RELAXED);
+    }
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+    out->name = cache->name;
+    out->obj_size = cache->size;
+    out->stride = cache->stride;
+    out->slabs = cache->slabs;
+    out->objs_total = cache->slabs * cache->objs_per_slab;
+    out->objs_active = cache->inuse > cached ? cache->inuse - cached : 0;
+    out->objs_cached = cached;
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    uint64_t slab_bytes = out->slabs * SLAB_SIZE;
+    uint64_t live_bytes = out->objs_active * out->obj_size;
+    out->frag_permille = slab_bytes ? 1000 - (live_bytes * 1000) / slab_bytes : 0;
+}
+
+struct kmem_cache *kmem_cache_next(struct kmem_cache *cache){
+    return cache ? cache->next_cache : cache_list;
+}
+
+void kmem_dump_stats(void){
+    struct kmem_cache_stats stats;
+
+    for(struct kmem_cache *cache = kmem_cache_next(NULL); cache; cache = kmem_cache_next(cache)){
+        kmem_cache_get_stats(cache, &stats);
+        debug_print(stats.name);
+        debug_print(": active ");
+        debug_print_dec(stats.objs_active);
+        debug_print("/");
+        debug_print_dec(stats.objs_total);
+        debug_print(" cached ");
+        debug_print_dec(stats.objs_cached);
+        debug_print(" slabs ");
+        debug_print_dec(stats.slabs);
+        debug_print(" frag ");
+        debug_print_dec(stats.frag_permille);
+        debug_print("/1000\n");
+    }
+}
\ No newline at end of file
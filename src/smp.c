@@ -0,0 +1,117 @@
+#include <smp.h>
+#include <limine.h>
+#include <vmm.h>
+#include <gdt.h>
+#include <idt.h>
+#include <fpu.h>
+#include <apic.h>
+#include <vmalloc.h>
+#include <sched.h>
+#include <syscall.h>
+#include <util.h>
+
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_mp_request mp_request = {
+    .id = LIMINE_MP_REQUEST_ID,
+    .revision = 0,
+    .flags = 0          // apic_init_cpu picks xAPIC or x2APIC itself
+};
+
+static struct cpu cpus[MAX_CPUS];
+static uint32_t cpus_online = 1;
+
+static void cpu_set_gs(struct cpu *cpu){
+    cpu->self = cpu;
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+    wrmsr(MSR_KERNEL_GS_BASE, 0);   // User GS, swapped in on the way out
+}
+
+void smp_init_bsp(void){
+    cpus[0].id = 0;
+    cpu_set_gs(&cpus[0]);
+}
+
+// Now on the stack smp_init gave us, Limine's may be reclaimed any time
+static void ap_main(void){
+    sched_init_cpu();
+    __atomic_fetch_add(&cpus_online, 1, __ATOMIC_RELEASE);
+    idle_loop();
+}
+
+static void ap_entry(struct limine_mp_info *info){
+    struct cpu *cpu = &cpus[info->extra_argument];
+    cpu_set_gs(cpu);
+
+    vmm_init_cpu();     // Off the bootloader's page tables
+    gdt_init();
+    syscall_init_cpu();
+    idt_init_cpu();
+    fpu_init();
+    apic_init_cpu();
+    cpu->apic_id = apic_id();
+
+    tss_set_stack(cpu->kernel_stack);
+    switch_stack(cpu->kernel_stack, ap_main);
+}
+
+void smp_init(void){
+    struct limine_mp_response *mp = mp_request.response;
+    if(mp == NULL){
+        debug_print("No MP response, running on the BSP only\n");
+        return;
+    }
+    cpus[0].apic_id = mp->bsp_lapic_id;
+
+    // TLB shootdowns need IPIs. apic_init brings the local APIC up whenever
+    // the CPU has one, and Limine can't start APs without it
+    if(!apic_present()){
+        if(mp->cpu_count > 1){
+            debug_print("APs without a local APIC\n");
+            hcf();
+        }
+        return;
+    }
+
+    uint32_t started = 0;
+    for(uint64_t i = 0; i < mp->cpu_count; i++){
+        struct limine_mp_info *info = mp->cpus[i];
+        if(info->lapic_id == mp->bsp_lapic_id) continue;
+        if(started + 1 == MAX_CPUS){
+            debug_print("More CPUs than MAX_CPUS, ignoring the rest\n");
+            break;
+        }
+
+        uint32_t id = ++started;
+        cpus[id].id = id;
+        cpus[id].apic_id = info->lapic_id;
+
+        // allocated here, APs never touch vmalloc before they are up
+        void *stack = kstack_alloc();
+        if(!stack){
+            debug_print("No stack for an AP\n");
+            started--;
+            break;
+        }
+        cpus[id].kernel_stack = (uint64_t)stack;
+
+        info->extra_argument = id;
+        __atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_SEQ_CST);
+    }
+
+    // the APs still run on bootloader memory until they count themselves in
+    while(__atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE) != started + 1){
+        cpu_relax();
+    }
+
+    debug_print("SMP: ");
+    debug_print_dec(cpus_online);
+    debug_print(" CPUs online\n");
+}
+
+uint32_t smp_cpu_count(void){
+    return __atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE);
+}
+
+struct cpu *smp_cpu(uint32_t id){
+    return &cpus[id];
+}
\ No newline at end of file
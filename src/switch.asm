@@ -0,0 +1,26 @@
+bits 64
+default rel
+
+global switch_context
+
+; void switch_context(uint64_t *prev_rsp, uint64_t next_rsp)
+; Only the callee-saved registers: the C caller has already spilled the rest,
+; and RFLAGS stays with interrupts off across the switch.
+switch_context:
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+
+    mov [rdi], rsp
+    mov rsp, rsi
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    ret
\ No newline at end of file
@@ -0,0 +1,179 @@
+bits 64
+default rel
+
+extern syscall_dispatch
+
+global syscall_entry
+global user_enter
+global user_bench_start
+global user_bench_end
+
+; Must match struct cpu (cpu.h), syscall.c checks them
+%define CPU_KERNEL_STACK 16
+%define CPU_USER_RSP     48
+
+%define USER_DATA_SEL (0x18 | 3)
+%define USER_CODE_SEL (0x20 | 3)
+
+%define SYSCALL_VECTOR 0x80
+%define SYS_NULL 0
+%define SYS_EXIT 2
+%define SYS_IPC_CALL 3
+
+; ipc_echo_thread's labels (ipc.c)
+%define IPC_ECHO_PING 1
+%define IPC_ECHO_STOP 2
+
+; --- SYSCALL ENTRY ---
+; RCX = user RIP, R11 = user RFLAGS, interrupts off (FMASK), still on the
+; user stack and the user GS base.
+syscall_entry:
+    swapgs
+    mov [gs:abs CPU_USER_RSP], rsp
+    mov rsp, [gs:abs CPU_KERNEL_STACK]
+
+    ; The user context in iretq frame order, SYSRET takes it back from here
+    push USER_DATA_SEL
+    push qword [gs:abs CPU_USER_RSP]
+    push r11
+    push USER_CODE_SEL
+    push rcx
+
+    ; struct syscall_frame: the number, then the arguments so that they
+    ; end up in order in memory
+    push rax
+    push r9
+    push r8
+    push r10
+    push rdx
+    push rsi
+    push rdi                 ; 12 pushes from the aligned stack top, still aligned
+
+    sti
+    mov rdi, rsp
+    call syscall_dispatch    ; Result in RAX
+    cli
+
+    ; IPC calls may have rewritten the message registers in the frame
+    pop rdi
+    pop rsi
+    pop rdx
+    pop r10
+    pop r8
+    pop r9
+    add rsp, 8               ; Number, RAX holds the result now
+
+    ; SYSRET with a non-canonical RCX would fault in ring 0 on the user
+    ; stack, but RCX is the address after the SYSCALL, and ring 3 can't map
+    ; the last page of the lower half (USER_MAP_END)
+    pop rcx
+    add rsp, 8               ; CS
+    pop r11
+    pop rsp                  ; User RSP, interrupts stay off until SYSRET
+    swapgs
+    o64 sysret
+
+; --- FIRST ENTRY INTO RING 3 ---
+; void user_enter(uint64_t rip, uint64_t rsp, uint64_t arg)
+user_enter:
+    cli
+    push USER_DATA_SEL
+    push rsi
+    push 0x202               ; IF
+    push USER_CODE_SEL
+    push rdi
+    mov rdi, rdx
+
+    ; Nothing of the kernel's in the user's registers
+    xor eax, eax
+    xor ebx, ebx
+    xor ecx, ecx
+    xor edx, edx
+    xor esi, esi
+    xor ebp, ebp
+    xor r8d, r8d
+    xor r9d, r9d
+    xor r10d, r10d
+    xor r11d, r11d
+    xor r12d, r12d
+    xor r13d, r13d
+    xor r14d, r14d
+    xor r15d, r15d
+
+    swapgs
+    iretq
+
+; --- RING 3 BENCHMARK ---
+; Copied into a user page by syscall_bench, so position independent.
+; RDI = data page: [0] iterations in, [1] SYSCALL cycles, [2] int cycles,
+; [3] set to 1 when done, [4] IPC call cycles, [5] wrong IPC replies.
+; Handle 0 is an endpoint served by ipc_echo_thread.
+user_bench_start:
+    mov r12, rdi
+
+    mov rbx, [r12]
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov r13, rax
+.syscall_loop:
+    mov eax, SYS_NULL
+    syscall
+    dec rbx
+    jnz .syscall_loop
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    sub rax, r13
+    mov [r12 + 8], rax
+
+    mov rbx, [r12]
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov r13, rax
+.int_loop:
+    mov eax, SYS_NULL
+    int SYSCALL_VECTOR
+    dec rbx
+    jnz .int_loop
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    sub rax, r13
+    mov [r12 + 16], rax
+
+    mov rbx, [r12]
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    mov r13, rax
+.ipc_loop:
+    mov eax, SYS_IPC_CALL
+    xor edi, edi             ; Handle 0
+    mov esi, IPC_ECHO_PING   ; Tag
+    mov rdx, rbx             ; Word 0, comes back incremented
+    syscall
+    lea rax, [rbx + 1]
+    cmp rdx, rax
+    je .ipc_ok
+    inc qword [r12 + 40]
+.ipc_ok:
+    dec rbx
+    jnz .ipc_loop
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    sub rax, r13
+    mov [r12 + 32], rax
+
+    mov eax, SYS_IPC_CALL
+    xor edi, edi
+    mov esi, IPC_ECHO_STOP
+    syscall
+
+    mov qword [r12 + 24], 1
+    mov eax, SYS_EXIT
+    syscall
+    ud2
+user_bench_end:
\ No newline at end of file
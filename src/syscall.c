@@ -0,0 +1,153 @@
+#include <syscall.h>
+#include <cpu.h>
+#include <gdt.h>
+#include <sched.h>
+#include <vmspace.h>
+#include <pmm.h>
+#include <ipc.h>
+#include <util.h>
+
+extern uint64_t hhdm_offset;
+
+extern void syscall_entry(void);
+extern const uint8_t user_bench_start[], user_bench_end[];
+
+// syscall.asm hardcodes these
+_Static_assert(offsetof(struct cpu, kernel_stack) == 16, "CPU_KERNEL_STACK in syscall.asm");
+_Static_assert(offsetof(struct cpu, user_rsp) == 48, "CPU_USER_RSP in syscall.asm");
+
+// What syscall_entry pushed, lowest address first
+struct syscall_frame {
+    uint64_t args[SYSCALL_ARGS];    // rdi, rsi, rdx, r10, r8, r9
+    uint64_t nr;
+    uint64_t rip, cs, rflags, rsp, ss;  // iretq frame
+};
+
+#define RFLAGS_TF (1 << 8)
+#define RFLAGS_IF (1 << 9)
+#define RFLAGS_DF (1 << 10)
+#define RFLAGS_AC (1 << 18)
+
+typedef uint64_t (*syscall_fn)(uint64_t *args);
+
+static uint64_t sys_null(uint64_t *args){
+    (void)args;
+    return 0;
+}
+
+static uint64_t sys_yield(uint64_t *args){
+    (void)args;
+    yield();
+    return 0;
+}
+
+static uint64_t sys_exit(uint64_t *args){
+    (void)args;
+    thread_exit();
+}
+
+static const syscall_fn syscall_table[SYS_COUNT] = {
+    [SYS_NULL]           = sys_null,
+    [SYS_YIELD]          = sys_yield,
+    [SYS_EXIT]           = sys_exit,
+    [SYS_IPC_CALL]       = ipc_sys_call,
+    [SYS_IPC_REPLY_WAIT] = ipc_sys_reply_wait,
+};
+
+uint64_t syscall_do(uint64_t nr, uint64_t args[SYSCALL_ARGS]){
+    if(nr >= SYS_COUNT) return SYSCALL_ENOSYS;
+    return syscall_table[nr](args);
+}
+
+// Called from syscall_entry with interrupts on. The arguments are used in
+// place, so an IPC message goes from one thread's saved registers straight
+// into the other's.
+uint64_t syscall_dispatch(struct syscall_frame *frame){
+    return syscall_do(frame->nr, frame->args);
+}
+
+void syscall_init_cpu(void){
+    // SYSCALL loads CS from STAR[47:32] and SS from + 8; SYSRET loads SS
+    // from STAR[63:48] + 8 and CS from + 16, both with RPL 3
+    uint64_t star = ((uint64_t)(GDT_USER_DATA - 8) << 48) | ((uint64_t)GDT_KERNEL_CODE << 32);
+
+    wrmsr(MSR_STAR, star);
+    wrmsr(MSR_LSTAR, (uint64_t)syscall_entry);
+    // the entry stub runs on the user stack until it switches, no IRQs there
+    wrmsr(MSR_FMASK, RFLAGS_TF | RFLAGS_IF | RFLAGS_DF | RFLAGS_AC);
+    wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
+}
+
+#define USER_BENCH_CODE  0x400000ULL
+#define USER_BENCH_DATA  0x600000ULL
+#define USER_BENCH_STACK 0x800000ULL    // Top, the page below is demand-zero
+
+void syscall_bench(uint64_t iterations){
+    if(iterations == 0) return;
+
+    struct vm_space *space = vmspace_create();
+    void *code = pmm_alloc_page();
+    void *data = pmm_alloc_zeroed_page();
+    if(!space || !code || !data){
+        debug_print("syscall_bench: out of memory\n");
+        if(space) vmspace_destroy(space);
+        if(code) pmm_page_put(code);
+        if(data) pmm_page_put(data);
+        return;
+    }
+
+    memcpy((void*)((uint64_t)code + hhdm_offset), user_bench_start, user_bench_end - user_bench_start);
+    vmm_map_page(space->pml4, USER_BENCH_CODE, (uint64_t)code, PTE_PRESENT | PTE_USER);
+    vmm_map_page(space->pml4, USER_BENCH_DATA, (uint64_t)data, PTE_PRESENT | PTE_RW | PTE_USER | PTE_NX);
+    vm_region_add(space, USER_BENCH_STACK - PAGE_SIZE, PAGE_SIZE, PTE_RW | PTE_USER | PTE_NX);
+
+    // the thread destroys the space when it exits, keep the results alive
+    pmm_page_ref(data);
+    volatile uint64_t *results = (uint64_t*)((uint64_t)data + hhdm_offset);
+    results[0] = iterations;
+
+    // handle 0: a kernel thread answering IPC calls from ring 3
+    struct endpoint *ep = endpoint_create();
+    struct thread *echo = ep ? thread_create("ipc_echo", ipc_echo_thread, ep, 0) : NULL;
+    struct thread *t = thread_create_user("syscall_bench", space, USER_BENCH_CODE,
+                                          USER_BENCH_STACK, USER_BENCH_DATA, 0);
+    if(!echo || !t){
+        debug_print("syscall_bench: no thread\n");
+        thread_destroy(echo);
+        if(t){
+            thread_destroy(t);      // Takes the space with it
+        } else {
+            vmspace_destroy(space);
+        }
+        if(ep) endpoint_destroy(ep);
+        pmm_page_put(data);
+        return;
+    }
+    ipc_handle_install(t, ep);
+    thread_wake(echo);
+    thread_wake(t);
+
+    while(results[3] == 0){
+        yield();
+    }
+
+    debug_print("null syscall round trip: SYSCALL ");
+    debug_print_dec(results[1] / iterations);
+    debug_print(" cycles, int ");
+    debug_print_dec(results[2] / iterations);
+    debug_print(" cycles\n");
+
+    debug_print("IPC call from ring 3: ");
+    debug_print_dec(results[4] / iterations);
+    debug_print(" cycles");
+    if(results[5]){
+        debug_print(", ");
+        debug_print_dec(results[5]);
+        debug_print(" wrong replies");
+    }
+    debug_print("\n");
+
+    // the echo thread has answered the stop call and is done with it
+    endpoint_destroy(ep);
+    pmm_page_put(data);
+}
\ No newline at end of file
@@ -1,21 +1,108 @@
 #include <util.h>
+#include <cpu.h>
+#include <stdbool.h>
 
-void *memcpy(void *__restrict dest, const void *restrict src, size_t n) {
-    uint8_t *restrict pdest = (uint8_t *restrict)dest;
-    const uint8_t *restrict psrc = (const uint8_t *restrict)src;
+//
+// String functions. mem_init picks the strategy once at boot: with FSRM
+// (fast short rep movsb) everything goes through rep movsb/stosb, with only
+// ERMS the rep forms are used once the length pays for their startup cost,
+// and otherwise we fall back to 8 byte words with an aligned destination.
+// Until mem_init runs (pmm_init and friends come after it) the word loops
+// are used, they work everywhere.
+//
+
+static bool mem_erms = false;
+static bool mem_fsrm = false;
+
+// Loads may be unaligned, stores always are after the head loop
+typedef uint64_t __attribute__((may_alias, aligned(1))) uword_t;
+typedef uint64_t __attribute__((may_alias)) word_t;
+
+void mem_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 7) return;
+
+    cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+    mem_erms = (ebx >> 9) & 1;
+    mem_fsrm = (edx >> 4) & 1;
+}
+
+static inline bool mem_use_rep(size_t n) {
+    return mem_fsrm || (mem_erms && n >= MEM_REP_THRESHOLD);
+}
+
+static inline void rep_movsb(void *dest, const void *src, size_t n) {
+    __asm__ volatile ("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+}
+
+static inline void rep_stosb(void *dest, uint8_t c, size_t n) {
+    __asm__ volatile ("rep stosb" : "+D"(dest), "+c"(n) : "a"(c) : "memory");
+}
+
+static void copy_bytes(uint8_t *d, const uint8_t *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        d[i] = s[i];
+    }
+}
+
+static void copy_words(uint8_t *d, const uint8_t *s, size_t n) {
+    // head: bytes until the destination is word aligned
+    while (n > 0 && ((uintptr_t)d & 7)) {
+        *d++ = *s++;
+        n--;
+    }
 
+    for (; n >= 8; n -= 8, d += 8, s += 8) {
+        *(word_t *)d = *(const uword_t *)s;
+    }
+
+    // tail
+    while (n > 0) {
+        *d++ = *s++;
+        n--;
+    }
+}
+
+static void set_bytes(uint8_t *d, uint8_t c, size_t n) {
     for (size_t i = 0; i < n; i++) {
-        pdest[i] = psrc[i];
+        d[i] = c;
+    }
+}
+
+static void set_words(uint8_t *d, uint8_t c, size_t n) {
+    uint64_t pattern = 0x0101010101010101ULL * c;
+
+    while (n > 0 && ((uintptr_t)d & 7)) {
+        *d++ = c;
+        n--;
+    }
+
+    for (; n >= 8; n -= 8, d += 8) {
+        *(word_t *)d = pattern;
+    }
+
+    while (n > 0) {
+        *d++ = c;
+        n--;
+    }
+}
+
+void *memcpy(void *__restrict dest, const void *restrict src, size_t n) {
+    if (mem_use_rep(n)) {
+        rep_movsb(dest, src, n);
+    } else {
+        copy_words(dest, src, n);
     }
 
     return dest;
 }
 
 void *memset(void *s, int c, size_t n) {
-    uint8_t *p = (uint8_t *)s;
-
-    for (size_t i = 0; i < n; i++) {
-        p[i] = (uint8_t)c;
+    if (mem_use_rep(n)) {
+        rep_stosb(s, (uint8_t)c, n);
+    } else {
+        set_words(s, (uint8_t)c, n);
     }
 
     return s;
@@ -25,14 +112,28 @@ void *memmove(void *dest, const void *src, size_t n) {
     uint8_t *pdest = (uint8_t *)dest;
     const uint8_t *psrc = (const uint8_t *)src;
 
-    if (src > dest) {
-        for (size_t i = 0; i < n; i++) {
-            pdest[i] = psrc[i];
-        }
-    } else if (src < dest) {
-        for (size_t i = n; i > 0; i--) {
-            pdest[i-1] = psrc[i-1];
-        }
+    // a forward copy is fine unless dest starts inside src
+    if (pdest <= psrc || pdest >= psrc + n) {
+        return memcpy(dest, src, n);
+    }
+
+    // backwards, words from the end (rep movsb with DF set is slow)
+    pdest += n;
+    psrc += n;
+    while (n > 0 && ((uintptr_t)pdest & 7)) {
+        *--pdest = *--psrc;
+        n--;
+    }
+
+    for (; n >= 8; n -= 8) {
+        pdest -= 8;
+        psrc -= 8;
+        *(word_t *)pdest = *(const uword_t *)psrc;
+    }
+
+    while (n > 0) {
+        *--pdest = *--psrc;
+        n--;
     }
 
     return dest;
@@ -42,6 +143,13 @@ int memcmp(const void *s1, const void *s2, size_t n) {
     const uint8_t *p1 = (const uint8_t *)s1;
     const uint8_t *p2 = (const uint8_t *)s2;
 
+    // skip equal words, the byte loop below finds where they differ
+    while (n >= 8 && *(const uword_t *)p1 == *(const uword_t *)p2) {
+        p1 += 8;
+        p2 += 8;
+        n -= 8;
+    }
+
     for (size_t i = 0; i < n; i++) {
         if (p1[i] != p2[i]) {
             return p1[i] < p2[i] ? -1 : 1;
@@ -51,6 +159,81 @@ int memcmp(const void *s1, const void *s2, size_t n) {
     return 0;
 }
 
+void memzero_page(void *page) {
+    // rep stosq is fast on everything that has long mode, ERMS or not
+    size_t count = 4096 / 8;
+    __asm__ volatile ("rep stosq" : "+D"(page), "+c"(count) : "a"(0ULL) : "memory");
+}
+
+void memcpy_page(void *dest, const void *src) {
+    size_t count = 4096 / 8;
+    __asm__ volatile ("rep movsq" : "+D"(dest), "+S"(src), "+c"(count) : : "memory");
+}
+
+// Cycles for one call of fn, best of a few runs so a cold cache or an
+// interrupt doesn't decide the result
+static uint64_t bench_one(void (*fn)(uint8_t *, const uint8_t *, size_t), uint8_t *d, const uint8_t *s, size_t n) {
+    uint64_t best = ~0ULL;
+    for (int run = 0; run < 8; run++) {
+        uint64_t start = rdtsc();
+        fn(d, s, n);
+        uint64_t cycles = rdtsc() - start;
+        if (cycles < best) best = cycles;
+    }
+    return best;
+}
+
+static void bench_copy_rep(uint8_t *d, const uint8_t *s, size_t n) {
+    rep_movsb(d, s, n);
+}
+
+static void bench_set_bytes(uint8_t *d, const uint8_t *s, size_t n) {
+    (void)s;
+    set_bytes(d, 0x5A, n);
+}
+
+static void bench_set_words(uint8_t *d, const uint8_t *s, size_t n) {
+    (void)s;
+    set_words(d, 0x5A, n);
+}
+
+static void bench_set_rep(uint8_t *d, const uint8_t *s, size_t n) {
+    (void)s;
+    rep_stosb(d, 0x5A, n);
+}
+
+void mem_bench(void *dest, const void *src, size_t max) {
+    static const struct {
+        const char *name;
+        void (*fn)(uint8_t *, const uint8_t *, size_t);
+    } variants[] = {
+        { "copy byte", copy_bytes },
+        { "copy word", copy_words },
+        { "copy rep ", bench_copy_rep },
+        { "set byte ", bench_set_bytes },
+        { "set word ", bench_set_words },
+        { "set rep  ", bench_set_rep },
+    };
+
+    debug_print("mem bench (cycles), erms=");
+    debug_print_dec(mem_erms);
+    debug_print(" fsrm=");
+    debug_print_dec(mem_fsrm);
+    debug_print("\n");
+
+    for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        debug_print(" ");
+        debug_print(variants[i].name);
+        for (size_t n = 16; n <= max; n *= 4) {
+            debug_print(" ");
+            debug_print_dec(n);
+            debug_print(":");
+            debug_print_dec(bench_one(variants[i].fn, dest, src, n));
+        }
+        debug_print("\n");
+    }
+}
+
 // Halt and catch fire function.
 void hcf(void) {
     for (;;) {
@@ -69,24 +252,35 @@ uint8_t inb(uint16_t port) {
     return ret;
 }
 
-// Minimal Serial Driver
-void serial_init() {
-    outb(0x3f8 + 1, 0x00);    // Disable all interrupts
-    outb(0x3f8 + 3, 0x80);    // Enable DLAB (set baud rate divisor)
-    outb(0x3f8 + 0, 0x03);    // Set divisor to 3 (lo byte) 38400 baud
-    outb(0x3f8 + 1, 0x00);    //                  (hi byte)
-    outb(0x3f8 + 3, 0x03);    // 8 bits, no parity, one stop bit
-    outb(0x3f8 + 2, 0xC7);    // Enable FIFO, clear them, with 14-byte threshold
-    outb(0x3f8 + 4, 0x0B);    // IRQs enabled, RTS/DSR set
+uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile ( "rdtsc" : "=a"(lo), "=d"(hi) );
+    return ((uint64_t)hi << 32) | lo;
 }
 
-void debug_putc(char c) {
-    while ((inb(0x3f8 + 5) & 0x20) == 0); // Wait for transmit buffer to be empty
-    outb(0x3f8, c);
+void debug_print_dec(uint64_t val) {
+    char buf[21];
+    int i = 20;
+
+    buf[i] = '\0';
+    do {
+        buf[--i] = '0' + (val % 10);
+        val /= 10;
+    } while (val != 0);
+
+    debug_print(&buf[i]);
 }
 
-void debug_print(const char* str) {
-    for (int i = 0; str[i] != '\0'; i++) {
-        outb(0x3F8, str[i]); // Simple outb usually works for QEMU stdio
+void debug_print_hex(uint64_t val) {
+    char buf[19];
+    const char *digits = "0123456789abcdef";
+
+    buf[0] = '0';
+    buf[1] = 'x';
+    for (int i = 0; i < 16; i++) {
+        buf[2 + i] = digits[(val >> (60 - i * 4)) & 0xF];
     }
+    buf[18] = '\0';
+
+    debug_print(buf);
 }
\ No newline at end of file
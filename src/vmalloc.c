@@ -0,0 +1,312 @@
+#include <vmalloc.h>
+#include <vmm.h>
+#include <pmm.h>
+#include <slab.h>
+#include <spinlock.h>
+#include <util.h>
+
+extern uint64_t hhdm_offset;
+extern uint64_t *kernel_pml4;
+
+//
+// Segregated fit over the vmalloc window. Free ranges sit on one list per
+// floor(log2(pages)), with a bitmask of the non-empty lists, so finding a
+// range that fits is a tzcnt. Neighbours for coalescing and the area behind
+// a vfree'd pointer are found through two hash tables (by start and by end),
+// so nothing here walks the set of areas and the cost stays flat no matter
+// how much of the window is in use.
+//
+
+#define AREA_FREE    0
+#define AREA_VMALLOC 1  // Backed by frames we own
+#define AREA_IOREMAP 2  // Someone else's physical memory
+
+struct vm_area {
+    uint64_t start;
+    uint64_t end;
+    uint32_t kind;
+    struct vm_area *bin_next;       // Free ranges: segregated list
+    struct vm_area *bin_prev;
+    struct vm_area *start_next;     // Hash chain by start, every area
+    struct vm_area *end_next;       // Hash chain by end, free ranges only
+};
+
+#define HASH_SIZE (1 << VMALLOC_HASH_BITS)
+
+static struct kmem_cache *area_cache;
+static spinlock_t vmalloc_lock = SPINLOCK_INIT;
+
+static struct vm_area *bins[VMALLOC_BINS];
+static uint64_t bins_nonempty = 0;
+static struct vm_area *by_start[HASH_SIZE];
+static struct vm_area *by_end[HASH_SIZE];
+static struct vmalloc_stats stats;
+
+static inline uint64_t area_pages(struct vm_area *area){
+    return (area->end - area->start) / PAGE_SIZE;
+}
+
+static inline uint32_t hash_addr(uint64_t addr){
+    return ((addr / PAGE_SIZE) * 0x9E3779B97F4A7C15ULL) >> (64 - VMALLOC_HASH_BITS);
+}
+
+static void bin_insert(struct vm_area *area){
+    unsigned int bin = 63 - __builtin_clzll(area_pages(area));
+
+    area->bin_prev = NULL;
+    area->bin_next = bins[bin];
+    if(bins[bin]) bins[bin]->bin_prev = area;
+    bins[bin] = area;
+    bins_nonempty |= 1ULL << bin;
+}
+
+static void bin_remove(struct vm_area *area){
+    unsigned int bin = 63 - __builtin_clzll(area_pages(area));
+
+    if(area->bin_prev) area->bin_prev->bin_next = area->bin_next;
+    else bins[bin] = area->bin_next;
+    if(area->bin_next) area->bin_next->bin_prev = area->bin_prev;
+
+    if(bins[bin] == NULL) bins_nonempty &= ~(1ULL << bin);
+}
+
+static void start_insert(struct vm_area *area){
+    uint32_t bucket = hash_addr(area->start);
+    area->start_next = by_start[bucket];
+    by_start[bucket] = area;
+}
+
+static void start_remove(struct vm_area *area){
+    struct vm_area **link = &by_start[hash_addr(area->start)];
+    while(*link != area) link = &(*link)->start_next;
+    *link = area->start_next;
+}
+
+static struct vm_area *start_find(uint64_t start){
+    for(struct vm_area *area = by_start[hash_addr(start)]; area; area = area->start_next){
+        if(area->start == start) return area;
+    }
+    return NULL;
+}
+
+static void end_insert(struct vm_area *area){
+    uint32_t bucket = hash_addr(area->end);
+    area->end_next = by_end[bucket];
+    by_end[bucket] = area;
+}
+
+static void end_remove(struct vm_area *area){
+    struct vm_area **link = &by_end[hash_addr(area->end)];
+    while(*link != area) link = &(*link)->end_next;
+    *link = area->end_next;
+}
+
+static struct vm_area *end_find(uint64_t end){
+    for(struct vm_area *area = by_end[hash_addr(end)]; area; area = area->end_next){
+        if(area->end == end) return area;
+    }
+    return NULL;
+}
+
+static void free_range_insert(struct vm_area *area){
+    area->kind = AREA_FREE;
+    bin_insert(area);
+    start_insert(area);
+    end_insert(area);
+    stats.free_ranges++;
+}
+
+static void free_range_remove(struct vm_area *area){
+    bin_remove(area);
+    start_remove(area);
+    end_remove(area);
+    stats.free_ranges--;
+}
+
+// Reserve pages of address space, returns the area or NULL
+static struct vm_area *area_alloc(uint64_t pages, uint32_t kind){
+    struct vm_area *area = kmem_cache_alloc(area_cache);
+    if(!area) return NULL;
+
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+
+    // every range in a list at or above ceil(log2(pages)) is big enough
+    unsigned int bin = pages == 1 ? 0 : 64 - __builtin_clzll(pages - 1);
+    uint64_t fits = bin < VMALLOC_BINS ? bins_nonempty & (~0ULL << bin) : 0;
+
+    struct vm_area *range = NULL;
+    if(fits){
+        range = bins[__builtin_ctzll(fits)];
+    } else {
+        // only the list below can still hold a large enough range
+        for(struct vm_area *r = bins[63 - __builtin_clzll(pages)]; r; r = r->bin_next){
+            if(area_pages(r) >= pages){
+                range = r;
+                break;
+            }
+        }
+    }
+
+    if(range == NULL){
+        spin_unlock_irqrestore(&vmalloc_lock, flags);
+        kmem_cache_free(area_cache, area);
+        return NULL;
+    }
+
+    // carve from the bottom, the rest of the range stays free
+    free_range_remove(range);
+    area->start = range->start;
+    area->end = range->start + pages * PAGE_SIZE;
+    area->kind = kind;
+    start_insert(area);
+
+    bool exact = area->end == range->end;
+    if(!exact){
+        range->start = area->end;
+        free_range_insert(range);
+    }
+
+    stats.areas++;
+    stats.used_bytes += area->end - area->start;
+
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+
+    if(exact) kmem_cache_free(area_cache, range);
+    return area;
+}
+
+// Take the area at start out of the index so nobody can reuse it while it
+// is being unmapped. NULL if start isn't an allocated area of that kind.
+static struct vm_area *area_detach(uint64_t start, uint32_t kind){
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+
+    struct vm_area *area = start_find(start);
+    if(area && area->kind == kind){
+        start_remove(area);
+        stats.areas--;
+        stats.used_bytes -= area->end - area->start;
+    } else {
+        area = NULL;
+    }
+
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    return area;
+}
+
+// Give an unmapped area back, merging it with free neighbours
+static void area_release(struct vm_area *area){
+    struct vm_area *dead[2] = { NULL, NULL };
+
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+
+    struct vm_area *left = end_find(area->start);
+    if(left){
+        free_range_remove(left);
+        area->start = left->start;
+        dead[0] = left;
+    }
+
+    struct vm_area *right = start_find(area->end);
+    if(right && right->kind == AREA_FREE){
+        free_range_remove(right);
+        area->end = right->end;
+        dead[1] = right;
+    }
+
+    free_range_insert(area);
+
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+
+    if(dead[0]) kmem_cache_free(area_cache, dead[0]);
+    if(dead[1]) kmem_cache_free(area_cache, dead[1]);
+}
+
+void vmalloc_init(void){
+    // the HHDM must end below the window
+    uint64_t phys_top = pmm_get_init_stats()->pages_tracked * PAGE_SIZE;
+    if(hhdm_offset + phys_top > VMALLOC_START) hcf();
+
+    area_cache = kmem_cache_create("vm_area", sizeof(struct vm_area), 0, NULL);
+    if(!area_cache) hcf();
+
+    struct vm_area *all = kmem_cache_alloc(area_cache);
+    if(!all) hcf();
+
+    // skip the first page: a guard below whatever lands at the bottom
+    all->start = VMALLOC_START + VMALLOC_GUARD_PAGES * PAGE_SIZE;
+    all->end = VMALLOC_END;
+    free_range_insert(all);
+}
+
+void *vmalloc(size_t size){
+    if(size == 0) return NULL;
+
+    uint64_t pages = DIV_ROUND_UP(size, PAGE_SIZE);
+    struct vm_area *area = area_alloc(pages + VMALLOC_GUARD_PAGES, AREA_VMALLOC);
+    if(!area) return NULL;
+
+    for(uint64_t i = 0; i < pages; i++){
+        void *frame = pmm_alloc_page();
+        if(!frame){
+            vfree((void*)area->start);
+            return NULL;
+        }
+
+        // global: the mapping is the same under every PCID
+        vmm_map_page(kernel_pml4, area->start + i * PAGE_SIZE, (uint64_t)frame,
+                     PTE_PRESENT | PTE_RW | PTE_NX | PTE_GLOBAL);
+    }
+
+    return (void*)area->start;
+}
+
+void vfree(void *addr){
+    if(addr == NULL) return;
+
+    struct vm_area *area = area_detach((uint64_t)addr, AREA_VMALLOC);
+    if(!area) hcf(); // not from vmalloc, or freed twice
+
+    vmm_release_range(kernel_pml4, area->start, area->end - area->start);
+    area_release(area);
+}
+
+void *kstack_alloc(void){
+    uint8_t *base = vmalloc(KSTACK_SIZE);
+    return base ? base + KSTACK_SIZE : NULL;
+}
+
+void kstack_free(void *top){
+    vfree((uint8_t*)top - KSTACK_SIZE);
+}
+
+void *ioremap(uint64_t phys, size_t size){
+    return ioremap_cache(phys, size, PTE_CACHE_UC);
+}
+
+void *ioremap_cache(uint64_t phys, size_t size, uint64_t cache){
+    uint64_t offset = phys & (PAGE_SIZE - 1);
+    uint64_t pages = DIV_ROUND_UP(offset + size, PAGE_SIZE);
+
+    struct vm_area *area = area_alloc(pages + VMALLOC_GUARD_PAGES, AREA_IOREMAP);
+    if(!area) return NULL;
+
+    vmm_map_range(kernel_pml4, area->start, phys - offset, pages * PAGE_SIZE,
+                  PTE_PRESENT | PTE_RW | PTE_NX | PTE_GLOBAL | cache);
+
+    return (void*)(area->start + offset);
+}
+
+void iounmap(void *addr){
+    struct vm_area *area = area_detach(ALIGN_DOWN((uint64_t)addr), AREA_IOREMAP);
+    if(!area) hcf();
+
+    // the frames belong to the device, only the mapping goes
+    vmm_unmap_range(kernel_pml4, area->start, area->end - area->start);
+    area_release(area);
+}
+
+void vmalloc_get_stats(struct vmalloc_stats *out){
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    *out = stats;
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+}
\ No newline at end of file
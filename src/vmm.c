@@ -2,6 +2,10 @@
 #include <pmm.h>
 #include <util.h>
 #include <limine.h>
+#include <cpu.h>
+#include <smp.h>
+#include <apic.h>
+#include <idt.h>
 #include <stdbool.h>
 
 //from linker script
@@ -12,10 +16,69 @@ extern uint8_t __data_start[], __data_end[]; // Data covers .bss too usually
 uint64_t *kernel_pml4 = NULL; //global kernel pml4
 extern uint64_t hhdm_offset;
 
+// PCIDs are direct mapped from the PML4 frame. pcid_owner remembers, per CPU,
+// which PML4 the TLB entries tagged with each PCID belong to; a switch keeps
+// those entries (CR3_NOFLUSH) only if the owner is still the same PML4.
+static bool pcid_enabled = false;
+static uint32_t pcid_owner[MAX_CPUS][PCID_SLOTS];
+
+static inline uint16_t pcid_of(uint64_t pml4_phys){
+    if(pml4_phys == (uint64_t)kernel_pml4 - hhdm_offset) return 0;
+    return 1 + (pml4_phys / PAGE_SIZE) % (PCID_SLOTS - 1);
+}
+
+// PML4 in each CPU's CR3, so a shootdown only interrupts the CPUs that
+// can have live entries for it
+static pml4_t *active_pml4[MAX_CPUS];
+
+// Forget the tag of a PML4 on every CPU but keep, so its stale entries get
+// flushed the next time one of them switches to it
+static void pcid_invalidate_except(pml4_t *pml4, uint32_t keep){
+    if(!pcid_enabled) return; // without PCIDs every CR3 load already flushes
+
+    uint64_t phys = (uint64_t)pml4 - hhdm_offset;
+    uint16_t pcid = pcid_of(phys);
+    for(uint32_t cpu = 0; cpu < MAX_CPUS; cpu++){
+        if(cpu == keep) continue;
+        uint32_t expected = phys / PAGE_SIZE;
+        __atomic_compare_exchange_n(&pcid_owner[cpu][pcid], &expected, 0,
+                                    false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+}
+
+// For a PML4 that isn't loaded here
+static void pcid_invalidate(pml4_t *pml4){
+    pcid_invalidate_except(pml4, MAX_CPUS);
+}
+
+
+// The kernel half's tables are shared by every PML4 and changed from any
+// CPU: vmalloc areas sit side by side, so a prune on one CPU can free the
+// table another is mapping into. Map, unmap and prune there go under this
+// lock; user tables are guarded by their vm_space lock. Never held across
+// a flush, a CPU spinning on it couldn't answer the shootdown.
+static spinlock_t kernel_pt_lock = SPINLOCK_INIT;
+
+static uint64_t pt_lock(uint64_t virt){
+    if(virt < KERNEL_SPACE_START) return 0;
+    return spin_lock_irqsave(&kernel_pt_lock);
+}
+
+static void pt_unlock(uint64_t virt, uint64_t flags){
+    if(virt < KERNEL_SPACE_START) return;
+    spin_unlock_irqrestore(&kernel_pt_lock, flags);
+}
+
+// table_flags go on the entry pointing at the next table; user half tables
+// need PTE_USER there, the leaf entry decides what is actually accessible
+static uint64_t *get_next_page(uint64_t *table, uint64_t index, bool allocate, uint64_t table_flags){
+    if((table[index] & (PTE_PRESENT | PTE_HUGE)) == (PTE_PRESENT | PTE_HUGE)){
+        hcf(); // Panic: walking into a 2 MiB/1 GiB page, splitting isn't supported
+    }
 
-static uint64_t *get_next_page(uint64_t *table, uint64_t index, bool allocate){
     if(table[index] & PTE_PRESENT){
         uint64_t phys = table[index] & PHYS_ADDR_MASK;
+        table[index] |= table_flags;
 
         return (uint64_t*)(phys + hhdm_offset);
     }
@@ -25,33 +88,610 @@ static uint64_t *get_next_page(uint64_t *table, uint64_t index, bool allocate){
     }
 
     //if neither statement has returned, the page table needs to be created still
-    void *new_table_phys = pmm_alloc_page();
+    //tables must start out empty, take one from the pre-zeroed pool
+    void *new_table_phys = pmm_alloc_zeroed_page();
     if (!new_table_phys) hcf(); // OOM Panic
 
-    //make a virtual mapping and zero out the new table
     uint64_t *new_table_virt = (uint64_t*)((uint64_t)new_table_phys + hhdm_offset);
-    memset(new_table_virt, 0, PAGE_SIZE);
 
-    table[index] = (uint64_t)new_table_phys | PTE_PRESENT | PTE_RW;
+    table[index] = (uint64_t)new_table_phys | PTE_PRESENT | PTE_RW | table_flags;
     
     return new_table_virt;
 }
 
-void vmm_map_page(pml4_t *pml4, uint64_t virt, uint64_t phys, uint64_t flags){
+// Walk down to the page table covering virt, NULL if it doesn't exist and
+// allocate is false
+static uint64_t *vmm_walk(pml4_t *pml4, uint64_t virt, bool allocate){
+    uint64_t table_flags = virt < USER_SPACE_END ? PTE_USER : 0;
+
+    uint64_t *pdpt = get_next_page(pml4, (virt >> 39) & 0x1FF, allocate, table_flags);
+    if(!pdpt) return NULL;
+    uint64_t *pd   = get_next_page(pdpt, (virt >> 30) & 0x1FF, allocate, table_flags);
+    if(!pd) return NULL;
+
+    return get_next_page(pd, (virt >> 21) & 0x1FF, allocate, table_flags);
+}
+
+uint64_t *vmm_get_pte(pml4_t *pml4, uint64_t virt){
+    uint64_t *pt = vmm_walk(pml4, virt, false);
+    if(!pt) return NULL;
+
+    return &pt[(virt >> 12) & 0x1FF];
+}
+
+// A one-page batch, so other CPUs get the shootdown too
+void vmm_invalidate_page(pml4_t *pml4, uint64_t virt){
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, pml4);
+    tlb_batch_add(&batch, virt);
+    tlb_batch_flush(&batch);
+}
+
+// Is this the address space the CPU is running on? Tables that aren't loaded
+// (e.g. the kernel PML4 while vmm_init builds it) never need a TLB flush.
+bool vmm_is_active(pml4_t *pml4){
+    uint64_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+
+    return (cr3 & PHYS_ADDR_MASK) == ((uint64_t)pml4 - hhdm_offset);
+}
+
+//
+// TLB flush batching: range operations collect the pages they changed and
+// flush once at the end. Past TLB_BATCH_MAX pages a CR3 reload is cheaper
+// than that many invlpgs, so the batch just remembers to do that instead.
+//
+void tlb_batch_init(struct tlb_batch *batch, pml4_t *pml4){
+    batch->pml4 = pml4;
+    batch->count = 0;
+    batch->full_flush = false;
+    batch->free_count = 0;
+}
+
+void tlb_batch_add(struct tlb_batch *batch, uint64_t virt){
+    if(batch->full_flush) return;
+
+    if(batch->count == TLB_BATCH_MAX){
+        batch->full_flush = true;
+        return;
+    }
+
+    batch->addrs[batch->count++] = virt;
+}
+
+// The kernel half is shared by every PML4, so its entries may be cached under
+// any PCID. invlpg reaches global entries and the current PCID, which covers
+// vmalloc (mapped global); a full flush toggles CR4.PGE to drop everything.
+static void kernel_flush(struct tlb_batch *batch){
+    if(batch->full_flush){
+        uint64_t cr4 = read_cr4();
+        write_cr4(cr4 ^ CR4_PGE);
+        write_cr4(cr4);
+        return;
+    }
+
+    for(uint32_t i = 0; i < batch->count; i++){
+        __asm__ volatile("invlpg (%0)" :: "r" (batch->addrs[i]) : "memory");
+    }
+
+    if(!vmm_is_active(kernel_pml4)) pcid_invalidate(kernel_pml4);
+}
+
+// This CPU's part of a flush, also run for a shootdown request
+static void flush_local(struct tlb_batch *batch){
+    if(batch->pml4 == kernel_pml4){
+        kernel_flush(batch);
+    } else if(vmm_is_active(batch->pml4)){
+        if(batch->full_flush){
+            // CR3 reads back without the no-flush bit, so this drops the
+            // current PCID's non-global entries
+            uint64_t cr3;
+            __asm__ volatile("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) :: "memory");
+        } else {
+            for(uint32_t i = 0; i < batch->count; i++){
+                __asm__ volatile("invlpg (%0)" :: "r" (batch->addrs[i]) : "memory");
+            }
+        }
+    } else {
+        pcid_invalidate(batch->pml4);
+    }
+}
+
+//
+// TLB shootdown: one request at a time, posted in shootdown_req, with an IPI
+// to each CPU that may cache the batch's entries. The initiator spins with
+// interrupts off until all of them have flushed, so it must not hold a lock
+// that a target could be spinning on with interrupts off. A CPU waiting for
+// its turn serves requests aimed at itself meanwhile.
+//
+struct shootdown_cpu {
+    uint32_t pending;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct shootdown_cpu shootdown_cpus[MAX_CPUS];
+static struct tlb_batch *shootdown_req;
+static uint32_t shootdown_busy = 0;
+static uint64_t shootdown_count = 0;
+
+static void shootdown_serve(void){
+    struct shootdown_cpu *self = &shootdown_cpus[cpu_id()];
+    if(!__atomic_load_n(&self->pending, __ATOMIC_ACQUIRE)) return;
+
+    flush_local(shootdown_req);
+    __atomic_store_n(&self->pending, 0, __ATOMIC_RELEASE);
+}
+
+static void shootdown_irq(struct interrupt_frame *frame, void *ctx){
+    (void)frame;
+    (void)ctx;
+    shootdown_serve();
+}
+
+// Flush here and on every other CPU that may cache the batch's entries.
+// Interrupts stay off throughout, so self is the CPU that flushed locally.
+static void shootdown(struct tlb_batch *batch){
+    uint64_t flags = irq_save();
+    flush_local(batch);
+
+    uint32_t cpus = smp_cpu_count();
+    if(cpus == 1){
+        irq_restore(flags);
+        return;
+    }
+
+    uint32_t self = cpu_id();
+    bool kernel = batch->pml4 == kernel_pml4;
+
+    // CPUs that switch to it later flush first; the fence pairs with the
+    // one in vmm_switch_pml4, so a CPU switching right now is either seen
+    // in active_pml4 or sees its tag gone
+    if(!kernel) pcid_invalidate_except(batch->pml4, self);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    while(__atomic_exchange_n(&shootdown_busy, 1, __ATOMIC_ACQUIRE)){
+        shootdown_serve();
+        cpu_relax();
+    }
+    shootdown_req = batch;
+
+    // kernel entries can be cached anywhere, user ones only where loaded
+    bool sent = false;
+    for(uint32_t cpu = 0; cpu < cpus; cpu++){
+        if(cpu == self) continue;
+        if(!kernel && __atomic_load_n(&active_pml4[cpu], __ATOMIC_SEQ_CST) != batch->pml4) continue;
+
+        __atomic_store_n(&shootdown_cpus[cpu].pending, 1, __ATOMIC_RELEASE);
+        apic_send_ipi(smp_cpu(cpu)->apic_id, TLB_SHOOTDOWN_VECTOR);
+        sent = true;
+    }
+
+    for(uint32_t cpu = 0; sent && cpu < cpus; cpu++){
+        while(__atomic_load_n(&shootdown_cpus[cpu].pending, __ATOMIC_ACQUIRE)){
+            cpu_relax();
+        }
+    }
+    if(sent) shootdown_count++;
+
+    __atomic_store_n(&shootdown_busy, 0, __ATOMIC_RELEASE);
+    irq_restore(flags);
+}
+
+uint64_t tlb_shootdown_count(void){
+    return __atomic_load_n(&shootdown_count, __ATOMIC_RELAXED);
+}
+
+void tlb_batch_flush(struct tlb_batch *batch){
+    if(batch->count == 0 && !batch->full_flush && batch->free_count == 0) return;
+
+    // with nothing invalidated, just hand back the pages
+    if(batch->count != 0 || batch->full_flush){
+        shootdown(batch);
+    }
+
+    for(uint32_t i = 0; i < batch->free_count; i++){
+        pmm_page_put((void*)batch->frees[i]);
+    }
+
+    batch->count = 0;
+    batch->full_flush = false;
+    batch->free_count = 0;
+}
+
+void tlb_batch_defer_free(struct tlb_batch *batch, uint64_t phys){
+    if(batch->free_count == TLB_BATCH_MAX_FREES){
+        tlb_batch_flush(batch);
+    }
+
+    batch->frees[batch->free_count++] = phys;
+}
+
+// Queue an emptied page table page (already unhooked from its parent)
+static void tlb_batch_free_table(struct tlb_batch *batch, uint64_t virt, uint64_t *table){
+    // invlpg on any address under the table also drops the paging-structure
+    // cache entries that point at it
+    tlb_batch_add(batch, virt);
+    // ...but only for the current PCID, kernel tables can be cached under all
+    if(batch->pml4 == kernel_pml4) batch->full_flush = true;
+    tlb_batch_defer_free(batch, (uint64_t)table - hhdm_offset);
+}
+
+static bool table_empty(uint64_t *table){
+    for(int i = 0; i < 512; i++){
+        if(table[i]) return false;
+    }
+    return true;
+}
+
+// Free the page tables above virt that no longer map anything. Kernel half
+// PDPTs are left alone, every address space shares them through its PML4.
+static void vmm_prune(struct tlb_batch *batch, pml4_t *pml4, uint64_t virt){
     uint64_t pml4_idx = (virt >> 39) & 0x1FF;
     uint64_t pdpt_idx = (virt >> 30) & 0x1FF;
     uint64_t pd_idx   = (virt >> 21) & 0x1FF;
+
+    uint64_t *pdpt = get_next_page(pml4, pml4_idx, false, 0);
+    if(!pdpt) return;
+    uint64_t *pd   = get_next_page(pdpt, pdpt_idx, false, 0);
+    if(!pd) return;
+    uint64_t *pt   = get_next_page(pd, pd_idx, false, 0);
+    if(!pt || !table_empty(pt)) return;
+
+    pd[pd_idx] = 0;
+    tlb_batch_free_table(batch, virt, pt);
+    if(!table_empty(pd)) return;
+
+    pdpt[pdpt_idx] = 0;
+    tlb_batch_free_table(batch, virt, pd);
+    if(pml4_idx >= 256 || !table_empty(pdpt)) return;
+
+    pml4[pml4_idx] = 0;
+    tlb_batch_free_table(batch, virt, pdpt);
+}
+
+void vmm_map_page(pml4_t *pml4, uint64_t virt, uint64_t phys, uint64_t flags){
+    uint64_t lock = pt_lock(virt);
     uint64_t pt_idx   = (virt >> 12) & 0x1FF;
+    uint64_t *pt      = vmm_walk(pml4, virt, true);
 
-    uint64_t *pdpt = get_next_page(pml4, pml4_idx, true);
-    uint64_t *pd   = get_next_page(pdpt, pdpt_idx, true);
-    uint64_t *pt   = get_next_page(pd,   pd_idx,   true);
+    // Only a live translation can be cached, a not-present entry never is
+    bool was_present = pt[pt_idx] & PTE_PRESENT;
 
     // Set the entry
     pt[pt_idx] = phys | flags;
-    
+    pt_unlock(virt, lock);
+
     // Flush TLB (invalidate cache for this page)
-    __asm__ volatile("invlpg (%0)" :: "r" (virt) : "memory");
+    if(was_present){
+        vmm_invalidate_page(pml4, virt);
+    }
+}
+
+void vmm_unmap_page(pml4_t *pml4, uint64_t virt){
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, pml4);
+
+    uint64_t lock = pt_lock(virt);
+    uint64_t *pt = vmm_walk(pml4, virt, false);
+    if(pt == NULL){
+        pt_unlock(virt, lock);
+        return;
+    }
+
+    uint64_t pt_idx = (virt >> 12) & 0x1FF;
+    if(pt[pt_idx] & PTE_PRESENT){
+        pt[pt_idx] = 0;
+        tlb_batch_add(&batch, virt);
+    }
+
+    vmm_prune(&batch, pml4, virt);
+    pt_unlock(virt, lock);
+    tlb_batch_flush(&batch);
+}
+
+void vmm_switch_pml4(pml4_t *pml4){
+    uint64_t phys = (uint64_t)pml4 - hhdm_offset;
+
+    uint64_t flags = irq_save();
+    __atomic_store_n(&active_pml4[cpu_id()], pml4, __ATOMIC_SEQ_CST);
+
+    if(!pcid_enabled){
+        __asm__ volatile("mov %0, %%cr3" :: "r" (phys) : "memory");
+        irq_restore(flags);
+        return;
+    }
+
+    uint16_t pcid = pcid_of(phys);
+    uint32_t *owner = &pcid_owner[cpu_id()][pcid];
+    uint64_t cr3 = phys | pcid;
+
+    // entries under this tag are ours unless someone took the slot since
+    if(__atomic_load_n(owner, __ATOMIC_RELAXED) == phys / PAGE_SIZE){
+        cr3 |= CR3_NOFLUSH;
+    } else {
+        __atomic_store_n(owner, phys / PAGE_SIZE, __ATOMIC_RELAXED);
+    }
+
+    __asm__ volatile("mov %0, %%cr3" :: "r" (cr3) : "memory");
+    irq_restore(flags);
+}
+
+void vmm_init_cpu(void){
+    //page switch (kowtow to the cpu overlords)
+    __asm__ volatile("mov %0, %%cr3" :: "r" ((uint64_t)kernel_pml4 - hhdm_offset) : "memory");
+    active_pml4[cpu_id()] = kernel_pml4;
+
+    // PAT entries 0-3 as after reset (WB, WT, UC-, UC), so plain PWT/PCD
+    // keep working; 4-7 add write-combining and write-protect. Every CPU
+    // must agree, and nothing maps with the PAT bit before this runs.
+    wrmsr(MSR_IA32_PAT, PAT_ENTRY(0, PAT_WB) | PAT_ENTRY(1, PAT_WT) |
+                        PAT_ENTRY(2, PAT_UCM) | PAT_ENTRY(3, PAT_UC) |
+                        PAT_ENTRY(4, PAT_WC) | PAT_ENTRY(5, PAT_WP) |
+                        PAT_ENTRY(6, PAT_UCM) | PAT_ENTRY(7, PAT_UC));
+
+    // the kernel must fault on read-only pages too, or its writes would
+    // land in frames shared copy-on-write
+    write_cr0(read_cr0() | CR0_WP);
+
+    uint64_t cr4 = read_cr4() | CR4_PGE;
+
+    // CR4.PCIDE may only be set while CR3 holds PCID 0, which the kernel PML4 does
+    if(pcid_enabled){
+        cr4 |= CR4_PCIDE;
+        pcid_owner[cpu_id()][0] = ((uint64_t)kernel_pml4 - hhdm_offset) / PAGE_SIZE;
+    }
+
+    write_cr4(cr4);
+}
+
+void vmm_map_range(pml4_t *pml4, uint64_t virt, uint64_t phys, uint64_t len, uint64_t flags){
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, pml4);
+
+    uint64_t start = virt;
+    uint64_t end = virt + ALIGN_UP(len);
+    uint64_t *pt = NULL;
+    uint64_t lock = pt_lock(start);
+
+    for(; virt < end; virt += PAGE_SIZE, phys += PAGE_SIZE){
+        uint64_t pt_idx = (virt >> 12) & 0x1FF;
+
+        // the same page table covers 512 consecutive pages, only walk again
+        // when we cross into the next one
+        if(pt == NULL || pt_idx == 0){
+            pt = vmm_walk(pml4, virt, true);
+        }
+
+        if(pt[pt_idx] & PTE_PRESENT){
+            tlb_batch_add(&batch, virt);
+        }
+        pt[pt_idx] = phys | flags;
+    }
+
+    pt_unlock(start, lock);
+    tlb_batch_flush(&batch);
+}
+
+// Flush once the deferred frees can't take n more. The page table lock for
+// virt and one the caller holds are dropped meanwhile, a CPU spinning on
+// either can't answer the shootdown.
+static void make_room(struct tlb_batch *batch, uint32_t n, spinlock_t *lock,
+                      uint64_t virt, uint64_t *pt_flags){
+    if(batch->free_count + n <= TLB_BATCH_MAX_FREES) return;
+
+    pt_unlock(virt, *pt_flags);
+    if(lock) spin_unlock(lock);
+    tlb_batch_flush(batch);
+    if(lock) spin_lock(lock);
+    *pt_flags = pt_lock(virt);
+}
+
+static void unmap_range(struct tlb_batch *batch, uint64_t virt, uint64_t len, bool free_frames,
+                        spinlock_t *lock){
+    pml4_t *pml4 = batch->pml4;
+    uint64_t start = virt;
+    uint64_t end = virt + ALIGN_UP(len);
+    uint64_t *pt = NULL;
+    bool walked = false;
+    uint64_t pt_flags = pt_lock(start);
+
+    while(virt < end){
+        uint64_t pt_idx = (virt >> 12) & 0x1FF;
+
+        // the tables may have changed while the lock was dropped
+        if(free_frames && batch->free_count == TLB_BATCH_MAX_FREES){
+            make_room(batch, 1, lock, start, &pt_flags);
+            walked = false;
+        }
+
+        if(!walked || pt_idx == 0){
+            pt = vmm_walk(pml4, virt, false);
+            walked = true;
+        }
+
+        // nothing mapped in this 2 MiB, skip straight to the next table
+        if(pt == NULL){
+            virt = (virt & ~(PAGE_SIZE_2M - 1)) + PAGE_SIZE_2M;
+            walked = false;
+            continue;
+        }
+
+        if(pt[pt_idx] & PTE_PRESENT){
+            uint64_t frame = pt[pt_idx] & PHYS_ADDR_MASK;
+            pt[pt_idx] = 0;
+            tlb_batch_add(batch, virt);
+            if(free_frames){
+                tlb_batch_defer_free(batch, frame);
+            }
+        }
+        virt += PAGE_SIZE;
+    }
+
+    // drop the page tables the range left empty, up to three per chunk
+    for(uint64_t chunk = start & ~(PAGE_SIZE_2M - 1); chunk < end; chunk += PAGE_SIZE_2M){
+        make_room(batch, 3, lock, start, &pt_flags);
+        vmm_prune(batch, pml4, chunk);
+    }
+    pt_unlock(start, pt_flags);
+}
+
+void vmm_unmap_range(pml4_t *pml4, uint64_t virt, uint64_t len){
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, pml4);
+    unmap_range(&batch, virt, len, false, NULL);
+    tlb_batch_flush(&batch);
+}
+
+void vmm_release_range(pml4_t *pml4, uint64_t virt, uint64_t len){
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, pml4);
+    unmap_range(&batch, virt, len, true, NULL);
+    tlb_batch_flush(&batch);
+}
+
+void vmm_release_range_locked(struct tlb_batch *batch, uint64_t virt, uint64_t len, spinlock_t *lock){
+    unmap_range(batch, virt, len, true, lock);
+}
+
+// Free every page table in the user half and drop the frames mapped there
+// (shared ones stay with the other owners), then free the PML4 itself.
+// The address space must not be loaded on any CPU.
+void vmm_destroy_pml4(pml4_t *pml4){
+    for(uint64_t i = 0; i < 256; i++){
+        uint64_t *pdpt = get_next_page(pml4, i, false, 0);
+        if(!pdpt) continue;
+
+        for(uint64_t j = 0; j < 512; j++){
+            uint64_t *pd = get_next_page(pdpt, j, false, 0);
+            if(!pd) continue;
+
+            for(uint64_t k = 0; k < 512; k++){
+                uint64_t *pt = get_next_page(pd, k, false, 0);
+                if(!pt) continue;
+
+                for(uint64_t l = 0; l < 512; l++){
+                    if(pt[l] & PTE_PRESENT){
+                        pmm_page_put((void*)(pt[l] & PHYS_ADDR_MASK));
+                    }
+                }
+                pmm_free_page((void*)((uint64_t)pt - hhdm_offset));
+            }
+            pmm_free_page((void*)((uint64_t)pd - hhdm_offset));
+        }
+        pmm_free_page((void*)((uint64_t)pdpt - hhdm_offset));
+    }
+
+    pcid_invalidate(pml4);
+    pmm_free_page((void*)((uint64_t)pml4 - hhdm_offset));
+}
+
+// Give dst a fresh, empty table at index with the same flags as src_entry
+static uint64_t *clone_table(uint64_t *dst, uint64_t index, uint64_t src_entry){
+    void *table_phys = pmm_alloc_zeroed_page();
+    if(!table_phys) return NULL;
+
+    dst[index] = (uint64_t)table_phys | (src_entry & ~PHYS_ADDR_MASK);
+    return (uint64_t*)((uint64_t)table_phys + hhdm_offset);
+}
+
+// Copy-on-write copy of an address space. The child gets its own user half
+// page tables, but both sides map the same frames: writable pages become
+// read-only + PTE_COW in parent and child, and the first write fault on
+// either side makes a private copy (see vmspace_handle_fault). The kernel
+// half is shared as usual. Returns NULL when out of memory.
+pml4_t *vmm_clone(pml4_t *pml4, struct tlb_batch *batch){
+    void *child_phys = pmm_alloc_zeroed_page();
+    if(!child_phys) return NULL;
+
+    pml4_t *child = (pml4_t*)((uint64_t)child_phys + hhdm_offset);
+    memcpy(&child[256], &pml4[256], 256 * sizeof(uint64_t));
+
+    bool oom = false;
+
+    for(uint64_t i = 0; i < 256 && !oom; i++){
+        uint64_t *pdpt = get_next_page(pml4, i, false, 0);
+        if(!pdpt) continue;
+        uint64_t *child_pdpt = clone_table(child, i, pml4[i]);
+        if(!child_pdpt){ oom = true; break; }
+
+        for(uint64_t j = 0; j < 512 && !oom; j++){
+            uint64_t *pd = get_next_page(pdpt, j, false, 0);
+            if(!pd) continue;
+            uint64_t *child_pd = clone_table(child_pdpt, j, pdpt[j]);
+            if(!child_pd){ oom = true; break; }
+
+            for(uint64_t k = 0; k < 512; k++){
+                uint64_t *pt = get_next_page(pd, k, false, 0);
+                if(!pt) continue;
+                uint64_t *child_pt = clone_table(child_pd, k, pd[k]);
+                if(!child_pt){ oom = true; break; }
+
+                for(uint64_t l = 0; l < 512; l++){
+                    uint64_t pte = pt[l];
+                    if(!(pte & PTE_PRESENT)) continue;
+
+                    if(pte & PTE_RW){
+                        pte = (pte & ~PTE_RW) | PTE_COW;
+                        pt[l] = pte;
+                        tlb_batch_add(batch, (i << 39) | (j << 30) | (k << 21) | (l << 12));
+                    }
+
+                    pmm_page_ref((void*)(pte & PHYS_ADDR_MASK));
+                    child_pt[l] = pte;
+                }
+            }
+        }
+    }
+
+    if(oom){
+        // drops the references taken so far, the parent's pages now fault
+        // once and get their write access back
+        vmm_destroy_pml4(child);
+        return NULL;
+    }
+
+    return child;
+}
+
+// Bit 7 is PS in a PDE/PDPTE, so the PAT bit moves up to bit 12 there
+static inline uint64_t huge_flags(uint64_t flags){
+    if(flags & PTE_PAT) flags = (flags & ~PTE_PAT) | PTE_PAT_HUGE;
+    return flags | PTE_HUGE;
+}
+
+// Huge page mappings. Only used while building the kernel tables, before they
+// are loaded, so no TLB flush is needed.
+static void vmm_map_2m(pml4_t *pml4, uint64_t virt, uint64_t phys, uint64_t flags){
+    uint64_t *pdpt = get_next_page(pml4, (virt >> 39) & 0x1FF, true, 0);
+    uint64_t *pd   = get_next_page(pdpt, (virt >> 30) & 0x1FF, true, 0);
+
+    pd[(virt >> 21) & 0x1FF] = phys | huge_flags(flags);
+}
+
+static void vmm_map_1g(pml4_t *pml4, uint64_t virt, uint64_t phys, uint64_t flags){
+    uint64_t *pdpt = get_next_page(pml4, (virt >> 39) & 0x1FF, true, 0);
+
+    pdpt[(virt >> 30) & 0x1FF] = phys | huge_flags(flags);
+}
+
+// Map [start, end) into the HHDM with the largest pages alignment allows,
+// 4 KiB pages are only left at the unaligned edges of the region
+static void vmm_map_hhdm_range(uint64_t start, uint64_t end, uint64_t flags, bool gb_pages){
+    uint64_t phys = start;
+
+    while(phys < end){
+        uint64_t virt = phys + hhdm_offset;
+
+        if(gb_pages && (phys % PAGE_SIZE_1G) == 0 && (virt % PAGE_SIZE_1G) == 0 && end - phys >= PAGE_SIZE_1G){
+            vmm_map_1g(kernel_pml4, virt, phys, flags);
+            phys += PAGE_SIZE_1G;
+        } else if((phys % PAGE_SIZE_2M) == 0 && (virt % PAGE_SIZE_2M) == 0 && end - phys >= PAGE_SIZE_2M){
+            vmm_map_2m(kernel_pml4, virt, phys, flags);
+            phys += PAGE_SIZE_2M;
+        } else {
+            vmm_map_page(kernel_pml4, virt, phys, flags);
+            phys += PAGE_SIZE;
+        }
+    }
 }
 
 __attribute__((used, section(".limine_requests")))
@@ -80,13 +720,21 @@ void vmm_init(struct limine_memmap_response *map){
     uint64_t phys_base = exec_addr_request.response->physical_base;
     uint64_t virt_base = exec_addr_request.response->virtual_base;
 
-    uint64_t kernel_pml4_phys = (uint64_t)pmm_alloc_page();
+    uint64_t kernel_pml4_phys = (uint64_t)pmm_alloc_zeroed_page();
     if (!kernel_pml4_phys) hcf(); // Panic: OOM
 
     kernel_pml4 = (uint64_t *)(kernel_pml4_phys + hhdm_offset);
-    memset(kernel_pml4, 0, PAGE_SIZE);
 
 
+    // 1 GiB pages are optional (CPUID.80000001h:EDX.Page1GB)
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    bool gb_pages = false;
+    if (eax >= 0x80000001) {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        gb_pages = (edx >> 26) & 1;
+    }
+
     //HHDM mapping
     // Flags: Present | ReadWrite | NX (Data shouldn't be executed)
     for (uint64_t i = 0; i < map->entry_count; i++) {
@@ -100,11 +748,11 @@ void vmm_init(struct limine_memmap_response *map){
             
             uint64_t start = ALIGN_DOWN(entry->base);
             uint64_t end   = ALIGN_UP(entry->base + entry->length);
-            
-            for (uint64_t phys = start; phys < end; phys += 4096) {
-                uint64_t virt = phys + hhdm_offset;
-                vmm_map_page(kernel_pml4, virt, phys, PTE_PRESENT | PTE_RW | PTE_NX);
-            }
+
+            // pixels are only ever written in bulk, let them combine
+            uint64_t cache = entry->type == LIMINE_MEMMAP_FRAMEBUFFER ? PTE_CACHE_WC : PTE_CACHE_WB;
+
+            vmm_map_hhdm_range(start, end, PTE_PRESENT | PTE_RW | PTE_NX | cache, gb_pages);
         }
     }
 
@@ -114,30 +762,37 @@ void vmm_init(struct limine_memmap_response *map){
     // uint64_t text_start = ALIGN_DOWN((uint64_t));
     uint64_t text_end   = ALIGN_UP((uint64_t)__text_end);
 
-    for (uint64_t virt = text_start; virt < text_end; virt += PAGE_SIZE) {
-        uint64_t phys = virt - virt_base + phys_base;
-        vmm_map_page(kernel_pml4, virt, phys, PTE_PRESENT); // RW bit cleared = RO
-    }
+    // The kernel image is the same in every address space: global pages keep
+    // it in the TLB across CR3 switches
+    vmm_map_range(kernel_pml4, text_start, text_start - virt_base + phys_base,
+                  text_end - text_start, PTE_PRESENT | PTE_GLOBAL); // RW bit cleared = RO
     
     // kernel rodata map
     uint64_t rodata_start = ALIGN_DOWN((uint64_t)__rodata_start);
     uint64_t rodata_end   = ALIGN_UP((uint64_t)__rodata_end);
 
-    for(uint64_t virt = rodata_start; virt < rodata_end; virt += PAGE_SIZE){
-        uint64_t phys = virt - virt_base + phys_base;
-        vmm_map_page(kernel_pml4, virt, phys, PTE_PRESENT | PTE_RW | PTE_NX);
-    }
+    vmm_map_range(kernel_pml4, rodata_start, rodata_start - virt_base + phys_base,
+                  rodata_end - rodata_start, PTE_PRESENT | PTE_RW | PTE_NX | PTE_GLOBAL);
 
 
     // kernel data
     uint64_t data_start = ALIGN_DOWN((uint64_t)__data_start);
     uint64_t data_end   = ALIGN_UP((uint64_t)__data_end);
 
-    for (uint64_t virt = data_start; virt < data_end; virt += PAGE_SIZE) {
-        uint64_t phys = virt - virt_base + phys_base;
-        vmm_map_page(kernel_pml4, virt, phys, PTE_PRESENT | PTE_RW | PTE_NX);
+    vmm_map_range(kernel_pml4, data_start, data_start - virt_base + phys_base,
+                  data_end - data_start, PTE_PRESENT | PTE_RW | PTE_NX | PTE_GLOBAL);
+
+    // Give every kernel half PML4 slot a PDPT now. Address spaces copy the
+    // kernel half of the PML4 once, so kernel mappings made later must land
+    // in tables they already share.
+    for (uint64_t i = 256; i < 512; i++) {
+        get_next_page(kernel_pml4, i, true, 0);
     }
 
-    //page switch (kowtow to the cpu overlords)
-    __asm__ volatile("mov %0, %%cr3" :: "r" (kernel_pml4_phys) : "memory");
+    // CPUID.01h:ECX.PCID
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    pcid_enabled = (ecx >> 17) & 1;
+
+    vmm_init_cpu();
+    irq_register(TLB_SHOOTDOWN_VECTOR, shootdown_irq, NULL);
 }
\ No newline at end of file
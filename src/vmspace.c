@@ -0,0 +1,335 @@
+#include <vmspace.h>
+#include <pmm.h>
+#include <slab.h>
+#include <util.h>
+#include <cpu.h>
+
+extern uint64_t hhdm_offset;
+extern uint64_t *kernel_pml4;
+
+struct vm_space kernel_space;
+static struct vm_space *current_space[MAX_CPUS];
+
+void vmspace_init(void){
+    kernel_space.pml4 = kernel_pml4;
+    kernel_space.lock = (spinlock_t)SPINLOCK_INIT;
+    kernel_space.regions = NULL;
+
+    for(uint32_t cpu = 0; cpu < MAX_CPUS; cpu++){
+        current_space[cpu] = &kernel_space;
+    }
+}
+
+struct vm_space *vmspace_create(void){
+    struct vm_space *space = kmalloc(sizeof(struct vm_space));
+    if(!space) return NULL;
+
+    void *pml4_phys = pmm_alloc_zeroed_page();
+    if(!pml4_phys){
+        kfree(space);
+        return NULL;
+    }
+
+    space->pml4 = (pml4_t*)((uint64_t)pml4_phys + hhdm_offset);
+    space->lock = (spinlock_t)SPINLOCK_INIT;
+    space->regions = NULL;
+
+    // share the kernel half, vmm_init gave every slot there a PDPT
+    memcpy(&space->pml4[256], &kernel_pml4[256], 256 * sizeof(uint64_t));
+
+    return space;
+}
+
+void vmspace_destroy(struct vm_space *space){
+    struct vm_region *region = space->regions;
+    while(region){
+        struct vm_region *next = region->next;
+        kfree(region);
+        region = next;
+    }
+
+    vmm_destroy_pml4(space->pml4);
+    kfree(space);
+}
+
+struct vm_space *vmspace_clone(struct vm_space *space){
+    struct vm_space *child = kmalloc(sizeof(struct vm_space));
+    if(!child) return NULL;
+
+    child->lock = (spinlock_t)SPINLOCK_INIT;
+    child->regions = NULL;
+    child->pml4 = NULL;
+
+    // hold the lock so no fault changes the tables while they are copied
+    uint64_t flags = spin_lock_irqsave(&space->lock);
+
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, space->pml4);
+    bool oom = false;
+    struct vm_region **tail = &child->regions;
+    for(struct vm_region *region = space->regions; region; region = region->next){
+        struct vm_region *copy = kmalloc(sizeof(struct vm_region));
+        if(!copy){
+            oom = true;
+            break;
+        }
+
+        *copy = *region;
+        copy->next = NULL;
+        *tail = copy;
+        tail = &copy->next;
+    }
+
+    if(!oom){
+        child->pml4 = vmm_clone(space->pml4, &batch);
+    }
+
+    spin_unlock_irqrestore(&space->lock, flags);
+
+    // the parent must not keep a writable TLB entry for a shared frame
+    tlb_batch_flush(&batch);
+
+    if(child->pml4 == NULL){
+        struct vm_region *region = child->regions;
+        while(region){
+            struct vm_region *next = region->next;
+            kfree(region);
+            region = next;
+        }
+        kfree(child);
+        return NULL;
+    }
+
+    return child;
+}
+
+void vmspace_switch(struct vm_space *space){
+    uint64_t flags = irq_save();
+    current_space[cpu_id()] = space;
+    vmm_switch_pml4(space->pml4);
+    irq_restore(flags);
+}
+
+struct vm_space *vmspace_current(void){
+    return current_space[cpu_id()];
+}
+
+// Region containing addr, caller holds space->lock
+static struct vm_region *region_find(struct vm_space *space, uint64_t addr){
+    for(struct vm_region *region = space->regions; region; region = region->next){
+        if(addr < region->start) break;
+        if(addr < region->end) return region;
+    }
+    return NULL;
+}
+
+bool vm_region_add(struct vm_space *space, uint64_t start, uint64_t len, uint64_t pte_flags){
+    uint64_t end = ALIGN_UP(start + len);
+    start = ALIGN_DOWN(start);
+
+    // must not wrap or straddle the canonical hole
+    if(end <= start) return false;
+    if(start < USER_SPACE_END && end > USER_MAP_END) return false;
+    if(start >= USER_SPACE_END && start < KERNEL_SPACE_START) return false;
+
+    struct vm_region *region = kmalloc(sizeof(struct vm_region));
+    if(!region) return false;
+
+    region->start = start;
+    region->end = end;
+    region->pte_flags = pte_flags | PTE_PRESENT;
+
+    uint64_t flags = spin_lock_irqsave(&space->lock);
+
+    // keep the list sorted, refuse anything overlapping a neighbour
+    struct vm_region **link = &space->regions;
+    while(*link && (*link)->end <= start){
+        link = &(*link)->next;
+    }
+
+    if(*link && (*link)->start < end){
+        spin_unlock_irqrestore(&space->lock, flags);
+        kfree(region);
+        return false;
+    }
+
+    region->next = *link;
+    *link = region;
+
+    spin_unlock_irqrestore(&space->lock, flags);
+    return true;
+}
+
+void vm_region_remove(struct vm_space *space, uint64_t start){
+    uint64_t flags = spin_lock_irqsave(&space->lock);
+
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, space->pml4);
+
+    struct vm_region **link = &space->regions;
+    while(*link && (*link)->start != start){
+        link = &(*link)->next;
+    }
+
+    struct vm_region *region = *link;
+    if(region){
+        *link = region->next;
+        // unmap under the lock so a fault can't map a page behind our back,
+        // the shootdown waits until it's dropped
+        vmm_release_range_locked(&batch, region->start, region->end - region->start, &space->lock);
+    }
+
+    spin_unlock_irqrestore(&space->lock, flags);
+    tlb_batch_flush(&batch);
+    kfree(region);
+}
+
+// Every page of [start, end) present (want) or absent (!want)
+static bool range_mapped(struct vm_space *space, uint64_t start, uint64_t end, bool want){
+    for(uint64_t virt = start; virt < end; virt += PAGE_SIZE){
+        uint64_t *pte = vmm_get_pte(space->pml4, virt);
+        bool present = pte && (*pte & PTE_PRESENT);
+        if(present != want) return false;
+        if(present && !(*pte & PTE_USER)) return false;
+    }
+    return true;
+}
+
+bool vmspace_grant(struct vm_space *from, uint64_t src, struct vm_space *to, uint64_t dst,
+                   uint64_t pages, bool move){
+    uint64_t len = pages * PAGE_SIZE;
+    if(from == to || pages == 0 || (src | dst) & (PAGE_SIZE - 1)) return false;
+    if(len / PAGE_SIZE != pages) return false;
+    if(src >= USER_MAP_END || USER_MAP_END - src < len) return false;
+    if(dst >= USER_MAP_END || USER_MAP_END - dst < len) return false;
+
+    // both locks, always in the same order
+    struct vm_space *first = from < to ? from : to;
+    struct vm_space *second = from < to ? to : from;
+    uint64_t flags = spin_lock_irqsave(&first->lock);
+    spin_lock(&second->lock);
+
+    // all or nothing: check every page before touching any
+    bool ok = range_mapped(from, src, src + len, true) &&
+              range_mapped(to, dst, dst + len, false);
+    for(uint64_t off = 0; ok && !move && off < len; off += PAGE_SIZE){
+        // a shared page has to stay shared, COW would split it on the first write
+        if(*vmm_get_pte(from->pml4, src + off) & PTE_COW) ok = false;
+    }
+
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, from->pml4);
+
+    for(uint64_t off = 0; ok && off < len; off += PAGE_SIZE){
+        uint64_t *pte = vmm_get_pte(from->pml4, src + off);
+        uint64_t entry = *pte;
+
+        // nothing was mapped at dst, so nothing there to flush
+        vmm_map_page(to->pml4, dst + off, entry & PHYS_ADDR_MASK, entry & ~PHYS_ADDR_MASK);
+        if(move){
+            // same frame, same reference, new owner
+            *pte = 0;
+            tlb_batch_add(&batch, src + off);
+        } else {
+            pmm_page_ref((void*)(entry & PHYS_ADDR_MASK));
+        }
+    }
+
+    spin_unlock(&second->lock);
+    spin_unlock_irqrestore(&first->lock, flags);
+
+    // outside the locks, a CPU in the sender's space may be spinning on them
+    tlb_batch_flush(&batch);
+    return ok;
+}
+
+// Write fault on a present page, only copy-on-write pages can be fixed.
+// Caller holds space->lock, and flushes batch once it has dropped it.
+static bool cow_break(struct vm_space *space, uint64_t page, uint64_t err_code,
+                      struct tlb_batch *batch){
+    uint64_t *pte = vmm_get_pte(space->pml4, page);
+    if(pte == NULL || !(*pte & PTE_PRESENT)) return false;
+    if((err_code & PF_USER) && !(*pte & PTE_USER)) return false;
+    if(*pte & PTE_RW) return true;  // another CPU broke it, our TLB was stale
+    if(!(*pte & PTE_COW)) return false;
+
+    uint64_t frame = *pte & PHYS_ADDR_MASK;
+    uint64_t flags = (*pte & ~(PHYS_ADDR_MASK | PTE_COW)) | PTE_RW;
+
+    if(pmm_page_refcount((void*)frame) == 1){
+        // every other sharer already made its copy, the frame is ours again
+        *pte = frame | flags;
+        tlb_batch_add(batch, page);
+        return true;
+    }
+
+    void *copy = pmm_alloc_page();
+    if(copy == NULL) return false;
+    memcpy_page((void*)((uint64_t)copy + hhdm_offset), (void*)(frame + hhdm_offset));
+
+    *pte = (uint64_t)copy | flags;
+    tlb_batch_add(batch, page);
+    // other CPUs may still read the old frame until the flush
+    tlb_batch_defer_free(batch, frame);
+    return true;
+}
+
+bool vmspace_handle_fault(uint64_t addr, uint64_t err_code){
+    // reserved bits set means corrupt page tables
+    if(err_code & PF_RSVD){
+        return false;
+    }
+
+    // the only protection violation we fix is a write to a shared page
+    if((err_code & PF_PRESENT) && !(err_code & PF_WRITE)){
+        return false;
+    }
+
+    struct vm_space *space;
+    if(addr >= KERNEL_SPACE_START){
+        if(err_code & PF_USER) return false;
+        space = &kernel_space;
+    } else if(addr < USER_SPACE_END){
+        space = vmspace_current();
+    } else {
+        return false; // non-canonical
+    }
+
+    uint64_t page = ALIGN_DOWN(addr);
+    bool handled = false;
+
+    struct tlb_batch batch;
+    tlb_batch_init(&batch, space->pml4);
+
+    // #PF runs through an interrupt gate, interrupts are already off
+    spin_lock(&space->lock);
+
+    if(err_code & PF_PRESENT){
+        handled = cow_break(space, page, err_code, &batch);
+        goto out;
+    }
+
+    struct vm_region *region = region_find(space, addr);
+    if(region == NULL) goto out;
+    if((err_code & PF_WRITE) && !(region->pte_flags & PTE_RW)) goto out;
+    if((err_code & PF_USER) && !(region->pte_flags & PTE_USER)) goto out;
+
+    // another CPU may have faulted the same page in first
+    uint64_t *pte = vmm_get_pte(space->pml4, page);
+    if(pte && (*pte & PTE_PRESENT)){
+        handled = true;
+        goto out;
+    }
+
+    void *frame = pmm_alloc_zeroed_page();
+    if(frame == NULL) goto out; // OOM, let the caller report it
+
+    vmm_map_page(space->pml4, page, (uint64_t)frame, region->pte_flags);
+    handled = true;
+
+out:
+    spin_unlock(&space->lock);
+    // not under the lock, a CPU spinning on it couldn't answer the shootdown
+    tlb_batch_flush(&batch);
+    return handled;
+}
\ No newline at end of file
@@ -0,0 +1,90 @@
+#include <work.h>
+#include <cpu.h>
+#include <stddef.h>
+
+//
+// One queue per CPU, a Treiber stack: producers push with a CAS on head, the
+// owning CPU takes the whole list with one exchange and reverses it so items
+// run in the order they were queued. No locks, so a hard-IRQ handler never
+// spins on a lock some interrupted code holds.
+//
+
+struct work_cpu {
+    struct work *head;
+    bool running;           // work_run is active, only touched by this CPU
+    uint64_t queued;
+    uint64_t ran;
+    uint64_t deferred;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct work_cpu work_cpus[MAX_CPUS];
+
+bool work_queue_on(uint32_t cpu, struct work *w){
+    if(__atomic_exchange_n(&w->pending, true, __ATOMIC_ACQ_REL)) return false;
+
+    struct work_cpu *wc = &work_cpus[cpu];
+    struct work *head = __atomic_load_n(&wc->head, __ATOMIC_RELAXED);
+    do {
+        w->next = head;
+    } while(!__atomic_compare_exchange_n(&wc->head, &head, w, true,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    __atomic_fetch_add(&wc->queued, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+bool work_queue(struct work *w){
+    return work_queue_on(cpu_id(), w);
+}
+
+bool work_pending(void){
+    return __atomic_load_n(&work_cpus[cpu_id()].head, __ATOMIC_RELAXED) != NULL;
+}
+
+void work_run(void){
+    struct work_cpu *wc = &work_cpus[cpu_id()];
+    if(wc->running) return;
+    wc->running = true;
+
+    // a switch now could resume us on another CPU, with wc someone else's
+    preempt_disable();
+
+    for(int batch = 0; batch < WORK_MAX_BATCHES; batch++){
+        struct work *list = __atomic_exchange_n(&wc->head, NULL, __ATOMIC_ACQUIRE);
+        if(!list) break;
+
+        struct work *fifo = NULL;
+        while(list){
+            struct work *next = list->next;
+            list->next = fifo;
+            fifo = list;
+            list = next;
+        }
+
+        // an interrupt that comes in now only queues, it doesn't recurse
+        __asm__ volatile("sti" ::: "memory");
+        while(fifo){
+            struct work *w = fifo;
+            fifo = w->next;
+
+            // cleared first so fn can queue w again
+            __atomic_store_n(&w->pending, false, __ATOMIC_RELEASE);
+            w->fn(w->ctx);
+            wc->ran++;
+        }
+        __asm__ volatile("cli" ::: "memory");
+    }
+
+    if(__atomic_load_n(&wc->head, __ATOMIC_RELAXED) != NULL) wc->deferred++;
+    wc->running = false;
+    preempt_enable();
+}
+
+void work_get_stats(struct work_stats *out){
+    out->queued = out->ran = out->deferred = 0;
+    for(int cpu = 0; cpu < MAX_CPUS; cpu++){
+        out->queued += __atomic_load_n(&work_cpus[cpu].queued, __ATOMIC_RELAXED);
+        out->ran += __atomic_load_n(&work_cpus[cpu].ran, __ATOMIC_RELAXED);
+        out->deferred += __atomic_load_n(&work_cpus[cpu].deferred, __ATOMIC_RELAXED);
+    }
+}
\ No newline at end of file